@@ -0,0 +1,714 @@
+/*
+ * bench.c - Trace driven benchmark for the allocator. Replays malloc lab
+ * traces, traces written by mm_trace_dump, and synthetic workloads, and
+ * reports the peak utilization and throughput of each.
+ *
+ * Usage: bench [-c] [-r reps] [-n ops] [-s seed] [-w prefix]
+ *              [-O option=value]... workload...
+ *
+ * A workload is a trace file or one of the generators gen:producer,
+ * gen:realloc, gen:powerlaw and gen:fragment. Trace files hold one request
+ * per line:
+ *
+ *   a <id> <size>	allocate block id
+ *   r <id> <size>	reallocate block id
+ *   f <id>		free block id
+ *
+ * Lines starting with '#' and the numeric header of malloc lab traces are
+ * skipped. Lines of the form "<ns> m|f|r ..." are mm_trace_dump output, and
+ * their pointers are mapped to ids as the trace is read.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mm.h"
+#include "memlib.h"
+#include "options.h"
+
+#define DEFAULT_OPS   200000	//Requests per generated workload
+#define DEFAULT_REPS  3		//Timed runs per workload, the best counts
+#define MAX_LINE      256
+
+//Gets the maximum and minimum of 2 arguments
+#define MAX(x, y) ((x) > (y) ? (x) : (y))
+#define MIN(x, y) ((x) < (y) ? (x) : (y))
+
+//One request of a workload
+struct op {
+	char type;		//'a' allocate, 'r' reallocate, 'f' free
+	int id;			//Block the request is about
+	size_t size;		//Requested bytes, unused for frees
+};
+
+//A workload ready to replay. Every block it allocates is freed by the end.
+struct trace {
+	const char *name;
+	struct op *ops;
+	size_t count;
+	size_t cap;
+	int ids;		//Block ids are below this
+};
+
+//Results of replaying one workload
+struct result {
+	double util;		//Peak live payload over peak footprint
+	double secs;		//Best time of the timed runs
+	int ok;
+};
+
+//Maps the pointers of an mm_trace_dump trace to block ids
+struct ptr_map {
+	uintptr_t *keys;	//0 is empty, 1 is a deleted slot
+	int *ids;
+	size_t cap;
+	size_t used;		//Slots taken, deleted ones included
+};
+
+static struct mm_options opts;	//Options every run starts mm_init_opts with
+static int check_payload;	//Verify block contents as they are replayed
+static unsigned long long rng_state;
+
+//Prints a message and exits.
+static void die(const char *msg, const char *arg)
+{
+	fprintf(stderr, "bench: %s%s%s\n", msg, arg != NULL ? ": " : "", arg != NULL ? arg : "");
+	exit(1);
+}
+
+//Allocates or dies, for the driver's own memory.
+static void * xrealloc(void *ptr, size_t size)
+{
+	if((ptr = realloc(ptr, size)) == NULL){
+		die("out of memory", NULL);
+  }
+	return ptr;
+}
+
+//Gets a uniformly distributed 64-bit number (splitmix64).
+static unsigned long long rng_next(void)
+{
+	unsigned long long z = (rng_state += 0x9e3779b97f4a7c15ULL);
+
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+//Gets a number in [lo, hi].
+static size_t rng_range(size_t lo, size_t hi)
+{
+	return lo + rng_next() % (hi - lo + 1);
+}
+
+//Gets a number in [0, 1).
+static double rng_unit(void)
+{
+	return (rng_next() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+//Appends one request to a trace.
+static void add_op(struct trace *t, char type, int id, size_t size)
+{
+	if(t->count == t->cap)
+		{
+			t->cap = MAX(2 * t->cap, 1024);
+			t->ops = xrealloc(t->ops, t->cap * sizeof(*t->ops));
+		}
+	t->ops[t->count].type = type;
+	t->ops[t->count].id = id;
+	t->ops[t->count].size = size;
+	t->count++;
+	if(id >= t->ids){
+		t->ids = id + 1;
+  }
+}
+
+//Finds the slot of key, or the free slot it would go in.
+static size_t map_slot(struct ptr_map *m, uintptr_t key)
+{
+	size_t i = (size_t)((key >> 4) * 0x9e3779b97f4a7c15ULL) & (m->cap - 1);
+	size_t free_slot = SIZE_MAX;
+
+	while(m->keys[i] != 0)
+		{
+			if(m->keys[i] == key){
+				return i;
+      }
+			if(m->keys[i] == 1 && free_slot == SIZE_MAX){
+				free_slot = i;
+      }
+			i = (i + 1) & (m->cap - 1);
+		}
+	return (free_slot != SIZE_MAX) ? free_slot : i;
+}
+
+//Maps key to id, growing the table while it stays below half full.
+static void map_put(struct ptr_map *m, uintptr_t key, int id)
+{
+	struct ptr_map old = *m;
+	size_t i;
+
+	if(2 * (m->used + 1) > m->cap)
+		{
+			m->cap = MAX(2 * m->cap, 1024);
+			m->keys = calloc(m->cap, sizeof(*m->keys));
+			m->ids = xrealloc(NULL, m->cap * sizeof(*m->ids));
+			if(m->keys == NULL){
+				die("out of memory", NULL);
+      }
+			m->used = 0;
+			for(i = 0; i < old.cap; i++)
+				{
+					if(old.keys[i] > 1)
+						{
+							map_put(m, old.keys[i], old.ids[i]);
+						}
+				}
+			free(old.keys);
+			free(old.ids);
+		}
+	i = map_slot(m, key);
+	if(m->keys[i] != key)
+		{
+			if(m->keys[i] == 0){
+				m->used++;
+      }
+			m->keys[i] = key;
+		}
+	m->ids[i] = id;
+}
+
+//Removes key and returns its id, or -1 if it is not mapped.
+static int map_take(struct ptr_map *m, uintptr_t key)
+{
+	size_t i;
+
+	if(m->cap == 0 || key <= 1){
+		return -1;
+  }
+	i = map_slot(m, key);
+	if(m->keys[i] != key){
+		return -1;
+  }
+	m->keys[i] = 1;
+	return m->ids[i];
+}
+
+//Reads one mm_trace_dump line into the trace. Blocks allocated before the
+//ring's window are unknown: their frees are dropped, their reallocs become
+//allocations.
+static void read_dump_line(struct trace *t, struct ptr_map *m, const char *line, int *next_id)
+{
+	unsigned long long ns;
+	char op;
+	void *ptr = NULL;
+	void *old = NULL;
+	size_t size = 0;
+	int id;
+
+	if(sscanf(line, "%llu %c", &ns, &op) != 2){
+		return;
+  }
+	line = strchr(line, op) + 1;
+	if(op == 'r' && sscanf(line, "%p %p %zu", &ptr, &old, &size) == 3)
+		{
+			if(old == NULL)
+				{
+					op = 'm';
+				}
+			else if(size == 0)
+				{
+					if((id = map_take(m, (uintptr_t)old)) >= 0){
+						add_op(t, 'f', id, 0);
+          }
+					return;
+				}
+			else if((id = map_take(m, (uintptr_t)old)) >= 0)
+				{
+					//A failed realloc leaves the old block in place.
+					if(ptr == NULL)
+						{
+							map_put(m, (uintptr_t)old, id);
+							return;
+						}
+					add_op(t, 'r', id, size);
+					map_put(m, (uintptr_t)ptr, id);
+					return;
+				}
+			else
+				{
+					op = 'm';
+				}
+		}
+	else if(op == 'm' && sscanf(line, "%p %zu", &ptr, &size) != 2)
+		{
+			return;
+		}
+	else if(op == 'f')
+		{
+			if(sscanf(line, "%p", &ptr) == 1 && (id = map_take(m, (uintptr_t)ptr)) >= 0){
+				add_op(t, 'f', id, 0);
+      }
+			return;
+		}
+	if(op == 'm' && ptr != NULL)
+		{
+			//A pointer reused before its free fell out of the window.
+			if((id = map_take(m, (uintptr_t)ptr)) >= 0){
+				add_op(t, 'f', id, 0);
+      }
+			add_op(t, 'a', *next_id, size);
+			map_put(m, (uintptr_t)ptr, (*next_id)++);
+		}
+}
+
+//Frees every block still live at the end of a trace, so replays start and
+//end with an empty heap.
+static void close_trace(struct trace *t)
+{
+	char *live = calloc(t->ids + 1, 1);
+	size_t i;
+	int id;
+
+	if(live == NULL){
+		die("out of memory", NULL);
+  }
+	for(i = 0; i < t->count; i++){
+		live[t->ops[i].id] = (t->ops[i].type != 'f');
+  }
+	for(id = 0; id < t->ids; id++)
+		{
+			if(live[id]){
+				add_op(t, 'f', id, 0);
+      }
+		}
+	free(live);
+}
+
+//Reads a malloc lab or mm_trace_dump trace.
+static void read_trace(struct trace *t, const char *path)
+{
+	struct ptr_map map = { NULL, NULL, 0, 0 };
+	char line[MAX_LINE];
+	char type;
+	int next_id = 0;
+	int id;
+	size_t size;
+	FILE *f;
+
+	if((f = fopen(path, "r")) == NULL){
+		die("cannot open trace", path);
+  }
+	while(fgets(line, sizeof(line), f) != NULL)
+		{
+			if(line[0] >= '0' && line[0] <= '9')
+				{
+					read_dump_line(t, &map, line, &next_id);
+				}
+			else if(sscanf(line, " %c %d %zu", &type, &id, &size) >= 2 && id >= 0 &&
+			        (type == 'a' || type == 'r' || type == 'f'))
+				{
+					add_op(t, type, id, (type == 'f') ? 0 : size);
+				}
+		}
+	fclose(f);
+	free(map.keys);
+	free(map.ids);
+	close_trace(t);
+}
+
+//Producer/consumer: messages of mixed sizes queue up and are freed in
+//arrival order once the queue is deep enough.
+static void gen_producer(struct trace *t, size_t n)
+{
+	int depth = 1024;
+	int head = 0;
+	int id;
+
+	for(id = 0; t->count < n; id++)
+		{
+			add_op(t, 'a', id, rng_range(32, 2048));
+			if(id - head >= depth){
+				add_op(t, 'f', head++, 0);
+      }
+		}
+}
+
+//Realloc growth: buffers grow by half again until they are large, then are
+//dropped and started over, with short lived small blocks in between.
+static void gen_realloc(struct trace *t, size_t n)
+{
+	size_t size[64] = { 0 };
+	int small = 64;
+	int b;
+
+	while(t->count < n)
+		{
+			b = (int)rng_range(0, 63);
+			if(size[b] == 0)
+				{
+					size[b] = rng_range(16, 128);
+					add_op(t, 'a', b, size[b]);
+				}
+			else if(size[b] < (1<<20))
+				{
+					size[b] += size[b] / 2;
+					add_op(t, 'r', b, size[b]);
+				}
+			else
+				{
+					size[b] = 0;
+					add_op(t, 'f', b, 0);
+				}
+			if(rng_range(0, 2) == 0)
+				{
+					add_op(t, 'a', small, rng_range(16, 256));
+					add_op(t, 'f', small, 0);
+					small++;
+				}
+		}
+}
+
+//Power law sizes: a Pareto distribution of sizes, mostly small with a long
+//tail, on a pool of live blocks freed at random.
+static void gen_powerlaw(struct trace *t, size_t n)
+{
+	int *live = xrealloc(NULL, 4096 * sizeof(*live));
+	int live_count = 0;
+	int next_id = 0;
+	int i;
+	double size;
+
+	while(t->count < n)
+		{
+			if(live_count == 4096 || (live_count > 0 && rng_range(0, 1) == 0))
+				{
+					i = (int)rng_range(0, live_count - 1);
+					add_op(t, 'f', live[i], 0);
+					live[i] = live[--live_count];
+				}
+			else
+				{
+					size = 16.0 / pow(1.0 - rng_unit(), 1.0 / 1.2);
+					add_op(t, 'a', next_id, (size_t)MIN(size, (double)(1<<20)));
+					live[live_count++] = next_id++;
+				}
+		}
+	free(live);
+}
+
+//Fragmenting pattern: fill with small blocks, free every other one, then
+//ask for blocks too big for the holes, with sizes doubling each round.
+static void gen_fragment(struct trace *t, size_t n)
+{
+	int next_id = 0;
+	int first;
+	int round;
+	int i;
+	size_t small;
+
+	for(round = 0; t->count < n; round++)
+		{
+			small = (size_t)16 << (round % 6);
+			first = next_id;
+			for(i = 0; i < 2048; i++){
+				add_op(t, 'a', next_id++, rng_range(small, 2 * small));
+      }
+			for(i = first; i < next_id; i += 2){
+				add_op(t, 'f', i, 0);
+      }
+			for(i = 0; i < 512; i++){
+				add_op(t, 'a', next_id++, rng_range(3 * small, 6 * small));
+      }
+			//Free the survivors of the round before last, keeping some debris.
+			if(round > 0)
+				{
+					for(i = first + 1; i < first + 2048; i += 2){
+						add_op(t, 'f', i, 0);
+          }
+				}
+		}
+}
+
+//Builds a workload from a generator name or a trace file.
+static void load_workload(struct trace *t, const char *name, size_t n, unsigned long long seed)
+{
+	memset(t, 0, sizeof(*t));
+	t->name = name;
+	rng_state = seed;
+	if(strcmp(name, "gen:producer") == 0){
+		gen_producer(t, n);
+  }
+	else if(strcmp(name, "gen:realloc") == 0){
+		gen_realloc(t, n);
+  }
+	else if(strcmp(name, "gen:powerlaw") == 0){
+		gen_powerlaw(t, n);
+  }
+	else if(strcmp(name, "gen:fragment") == 0){
+		gen_fragment(t, n);
+  }
+	else if(strncmp(name, "gen:", 4) == 0){
+		die("unknown generator", name);
+  }
+	else
+		{
+			read_trace(t, name);
+			return;
+		}
+	close_trace(t);
+}
+
+//Writes a workload as a trace file, so generated and converted workloads
+//can be kept and replayed later.
+static void write_trace(const struct trace *t, const char *prefix)
+{
+	char path[1024];
+	const char *base = strrchr(t->name, '/');
+	size_t i;
+	FILE *f;
+
+	base = (base != NULL) ? base + 1 : t->name;
+	snprintf(path, sizeof(path), "%s%s.rep", prefix, strncmp(base, "gen:", 4) == 0 ? base + 4 : base);
+	if((f = fopen(path, "w")) == NULL){
+		die("cannot write trace", path);
+  }
+	fprintf(f, "# %s, %zu requests, %d ids\n", t->name, t->count, t->ids);
+	for(i = 0; i < t->count; i++)
+		{
+			if(t->ops[i].type == 'f'){
+				fprintf(f, "f %d\n", t->ops[i].id);
+      }
+			else{
+				fprintf(f, "%c %d %zu\n", t->ops[i].type, t->ops[i].id, t->ops[i].size);
+      }
+		}
+	fclose(f);
+}
+
+//Stamps the first and last payload bytes of a block with its id.
+static void stamp(unsigned char *ptr, int id, size_t size)
+{
+	ptr[size - 1] = (unsigned char)(id ^ 0xa5);
+	ptr[0] = (unsigned char)(id ^ 0x5a);
+}
+
+//Checks the stamp of a block of size bytes whose first kept bytes are
+//still there, as after a realloc that shrank it.
+static int stamp_ok(const unsigned char *ptr, int id, size_t size, size_t kept)
+{
+	return ptr[0] == (unsigned char)(id ^ 0x5a) &&
+	       (kept < size || size == 1 || ptr[size - 1] == (unsigned char)(id ^ 0xa5));
+}
+
+//Replays a workload once against a fresh heap. With sizes and stamps it
+//tracks live bytes and the peak utilization; without, it only runs it.
+static int replay(const struct trace *t, void **ptrs, size_t *sizes, double *util)
+{
+	size_t live = 0;
+	size_t peak_live = 0;
+	size_t peak_footprint = 0;
+	size_t i;
+	struct op *op;
+	void *ptr;
+
+	mem_reset_brk();
+	if(mm_init_opts(&opts) < 0)
+		{
+			fprintf(stderr, "bench: mm_init_opts failed\n");
+			return 0;
+		}
+	for(i = 0; i < t->count; i++)
+		{
+			op = &t->ops[i];
+			if(op->type == 'f')
+				{
+					if(sizes != NULL)
+						{
+							if(check_payload && sizes[op->id] != 0 && !stamp_ok(ptrs[op->id], op->id, sizes[op->id], sizes[op->id]))
+								{
+									fprintf(stderr, "bench: %s: block %d damaged before request %zu\n", t->name, op->id, i);
+									return 0;
+								}
+							live -= sizes[op->id];
+							sizes[op->id] = 0;
+						}
+					mm_free(ptrs[op->id]);
+					ptrs[op->id] = NULL;
+					continue;
+				}
+			if(op->type == 'a'){
+				ptr = mm_malloc(op->size);
+      }
+			else{
+				ptr = mm_realloc(ptrs[op->id], op->size);
+      }
+			if(ptr == NULL && op->size != 0)
+				{
+					fprintf(stderr, "bench: %s: out of memory at request %zu\n", t->name, i);
+					return 0;
+				}
+			ptrs[op->id] = ptr;
+			if(sizes == NULL){
+				continue;
+      }
+			if(check_payload && op->type == 'r' && sizes[op->id] != 0 &&
+			   !stamp_ok(ptr, op->id, sizes[op->id], op->size))
+				{
+					fprintf(stderr, "bench: %s: realloc of block %d lost data at request %zu\n", t->name, op->id, i);
+					return 0;
+				}
+			if(check_payload && op->size != 0){
+				stamp(ptr, op->id, op->size);
+      }
+			live = live - sizes[op->id] + op->size;
+			sizes[op->id] = op->size;
+			peak_live = MAX(peak_live, live);
+			peak_footprint = MAX(peak_footprint, mm_footprint());
+		}
+	if(util != NULL){
+		*util = (peak_footprint != 0) ? (double)peak_live / peak_footprint : 0.0;
+  }
+	return 1;
+}
+
+//Measures one workload: an untimed pass for utilization, then the timed
+//runs.
+static struct result measure(const struct trace *t, int reps)
+{
+	struct result r = { 0.0, 0.0, 0 };
+	void **ptrs = calloc(t->ids + 1, sizeof(*ptrs));
+	size_t *sizes = calloc(t->ids + 1, sizeof(*sizes));
+	double start;
+	double secs;
+	int i;
+
+	if(ptrs == NULL || sizes == NULL){
+		die("out of memory", NULL);
+  }
+	if(!replay(t, ptrs, sizes, &r.util)){
+		goto done;
+  }
+	for(i = 0; i < reps; i++)
+		{
+			start = now();
+			if(!replay(t, ptrs, NULL, NULL)){
+				goto done;
+      }
+			secs = now() - start;
+			if(i == 0 || secs < r.secs){
+				r.secs = secs;
+      }
+		}
+	r.ok = 1;
+done:
+	free(ptrs);
+	free(sizes);
+	return r;
+}
+
+//Sets an mm_options field from a name=value argument.
+static void set_option(const char *arg)
+{
+	int ret = option_set(&opts, arg);
+
+	if(ret == -1){
+		die("expected option=value", arg);
+  }
+	if(ret == -2){
+		die("unknown option", arg);
+  }
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+	        "usage: bench [-c] [-r reps] [-n ops] [-s seed] [-w prefix] [-O option=value]... workload...\n"
+	        "  -c  check block contents while measuring utilization\n"
+	        "  -r  timed runs per workload, the best counts (default %d)\n"
+	        "  -n  requests per generated workload (default %d)\n"
+	        "  -s  generator seed\n"
+	        "  -w  also write each workload to <prefix><name>.rep\n"
+	        "  -O  set an mm_options field, e.g. -O insert_policy=1\n"
+	        "workloads: trace files, gen:producer, gen:realloc, gen:powerlaw, gen:fragment\n",
+	        DEFAULT_REPS, DEFAULT_OPS);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct trace t;
+	struct result r;
+	const char *prefix = NULL;
+	unsigned long long seed = 1;
+	size_t n = DEFAULT_OPS;
+	size_t total_ops = 0;
+	double total_secs = 0.0;
+	double total_util = 0.0;
+	int reps = DEFAULT_REPS;
+	int measured = 0;
+	int failed = 0;
+	int c;
+
+	while((c = getopt(argc, argv, "cr:n:s:w:O:")) != -1)
+		{
+			switch(c)
+				{
+				case 'c': check_payload = 1; break;
+				case 'r': reps = MAX(atoi(optarg), 1); break;
+				case 'n': n = strtoul(optarg, NULL, 0); break;
+				case 's': seed = strtoull(optarg, NULL, 0); break;
+				case 'w': prefix = optarg; break;
+				case 'O': set_option(optarg); break;
+				default: usage();
+				}
+		}
+	if(optind == argc){
+		usage();
+  }
+	mem_init();
+	printf("%-24s %10s %8s %12s\n", "workload", "requests", "util", "Kops/s");
+	for(; optind < argc; optind++)
+		{
+			load_workload(&t, argv[optind], n, seed);
+			if(prefix != NULL){
+				write_trace(&t, prefix);
+      }
+			r = measure(&t, reps);
+			if(!r.ok)
+				{
+					printf("%-24s %10zu %8s %12s\n", t.name, t.count, "-", "failed");
+					failed = 1;
+				}
+			else
+				{
+					printf("%-24s %10zu %7.1f%% %12.0f\n", t.name, t.count,
+					       100.0 * r.util, t.count / r.secs / 1000.0);
+					total_ops += t.count;
+					total_secs += r.secs;
+					total_util += r.util;
+					measured++;
+				}
+			free(t.ops);
+		}
+	if(measured > 1){
+		printf("%-24s %10zu %7.1f%% %12.0f\n", "total", total_ops,
+		       100.0 * total_util / measured, total_ops / total_secs / 1000.0);
+  }
+	mem_deinit();
+	return failed;
+}
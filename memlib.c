@@ -0,0 +1,105 @@
+/*
+ * memlib.c - A simple model of the memory system, backing mem_sbrk with one
+ * reserved mapping so the heap stays contiguous and its pages start zeroed.
+ */
+#include <stdio.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+#include "memlib.h"
+
+//Address space reserved for the heap. Pages are only committed on use.
+#define MAX_HEAP  ((size_t)1<<32)
+
+static char *mem_start_brk;	//First byte of the heap
+static char *mem_brk;		//One past the last byte of the heap
+static char *mem_max_addr;	//End of the reservation
+
+/*
+ * mem_init - Reserves the heap and sets it empty.
+ */
+void mem_init(void)
+{
+	mem_start_brk = mmap(NULL, MAX_HEAP, PROT_READ | PROT_WRITE,
+	                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if(mem_start_brk == MAP_FAILED)
+		{
+			fprintf(stderr, "mem_init: cannot reserve the heap\n");
+			_exit(1);
+		}
+	mem_max_addr = mem_start_brk + MAX_HEAP;
+	mem_brk = mem_start_brk;
+}
+
+/*
+ * mem_deinit - Releases the heap.
+ */
+void mem_deinit(void)
+{
+	munmap(mem_start_brk, MAX_HEAP);
+	mem_start_brk = NULL;
+	mem_brk = NULL;
+	mem_max_addr = NULL;
+}
+
+/*
+ * mem_reset_brk - Empties the heap and gives its pages back, so the next
+ * run starts from zeroed memory like a fresh process.
+ */
+void mem_reset_brk(void)
+{
+	if(mem_brk > mem_start_brk){
+		madvise(mem_start_brk, mem_brk - mem_start_brk, MADV_DONTNEED);
+  }
+	mem_brk = mem_start_brk;
+}
+
+/*
+ * mem_sbrk - Grows the heap by incr bytes and returns the old break, or
+ * (void *)-1 with errno set. The heap cannot shrink.
+ */
+void *mem_sbrk(int incr)
+{
+	char *old_brk = mem_brk;
+
+	if(incr < 0 || (size_t)incr > (size_t)(mem_max_addr - mem_brk))
+		{
+			errno = ENOMEM;
+			fprintf(stderr, "mem_sbrk: the heap is out of memory\n");
+			return (void *)-1;
+		}
+	mem_brk += incr;
+	return old_brk;
+}
+
+/*
+ * mem_heap_lo - Gets the first byte of the heap.
+ */
+void *mem_heap_lo(void)
+{
+	return mem_start_brk;
+}
+
+/*
+ * mem_heap_hi - Gets the last byte of the heap.
+ */
+void *mem_heap_hi(void)
+{
+	return mem_brk - 1;
+}
+
+/*
+ * mem_heapsize - Gets the heap size in bytes.
+ */
+size_t mem_heapsize(void)
+{
+	return mem_brk - mem_start_brk;
+}
+
+/*
+ * mem_pagesize - Gets the system page size.
+ */
+size_t mem_pagesize(void)
+{
+	return (size_t)getpagesize();
+}
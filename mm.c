@@ -3,11 +3,26 @@
  * Uses a segregated list implementation of a DMA. Each size class of
  * blocks has its own free list.
  */
+#define _GNU_SOURCE		//For mremap
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <unistd.h>
 #include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
+#ifdef MM_TRACE
+#include <time.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "mm.h"
 #include "memlib.h"
@@ -17,28 +32,89 @@
 #define ALIGN(size) (((size) + (ALIGNMENT-1)) & ~0x7)
 
 //Additional concepts that will be useful
+//Building with MM_COMPACT halves the word: 4-byte headers and free list
+//links stored as offsets from the arena's heap_lo, for heaps under 4 GB.
+#ifdef MM_COMPACT
+#define WSIZE      4 	     	//In bytes
+#define DWORD      8 		  //Double word in bytes
+typedef uint32_t word_t;
+#else
 #define WSIZE      8 	     	//In bytes
 #define DWORD      16 		  //Double word in bytes
-#define CHUNKSIZE  (1<<8)	    //Heap extension in bytes
-#define MAX_LISTS  16		//Total list count
-#define MAX_LIST_SIZE ((1)<<(MAX_LISTS))  //Maximum size class
+typedef size_t word_t;
+#endif
+#define CHUNKSIZE  (1<<8)	    //Smallest heap extension in bytes
+
+//Heap growth and trim policy defaults
+#define GROW_MAX        (1<<20)	//Largest heap extension in bytes
+#define GROW_WINDOW     64	//Mallocs between misses that count as a ramp
+#define TRIM_THRESHOLD  (1<<20)	//Trailing free bytes that trigger a trim
+
+//Size class layout. Each power of two above SMALL_LIST_LIMIT is split into
+//SL_COUNT sub-classes (TLSF style), so a class bounds its block sizes to
+//within a quarter of a power of two.
+#define SL_SHIFT   2			//Log2 of sub-classes per power of two
+#define SL_COUNT   (1<<SL_SHIFT)	//Sub-classes per power of two
+#define FL_COUNT   16			//Power of two ranges with their own classes
+#define FL_SHIFT   (SL_SHIFT + 4)	//Log2 of the first power of two range
+#define MAX_LISTS  (FL_COUNT * SL_COUNT)	//Total list count
+#define SMALL_LIST_LIMIT (1<<10)	//Sizes below this use small_list
 
 #define SIZE_T_SIZE (ALIGN(sizeof(size_t)))
 
-//Gets the maximum of 2 arguments
+//Block format. Allocated blocks carry only a header; the prev-alloc bit in
+//the next block's header stands in for their footer. Free blocks add the
+//two list links and a footer, which sets the smallest block size.
+#define MIN_BLOCK        (4 * WSIZE)	//Header, links and footer
+#define SPLIT_THRESHOLD  MIN_BLOCK	//Smallest leftover worth splitting off
+
+//Gets the maximum and minimum of 2 arguments
 #define MAX(x, y) ((x) > (y) ? (x) : (y))
+#define MIN(x, y) ((x) < (y) ? (x) : (y))
 
 //Add status bits into a word
 #define PACK(size, prev_alloc, alloc)   ((size) | (prev_alloc) | (alloc))
 
 //Read and write at address p
-#define GET(p)              (*(size_t *)(p))
-#define PUT(p, val)         (*(size_t *)(p) = (size_t)(val))
+#define GET(p)              (*(word_t *)(p))
+#define PUT(p, val)         (*(word_t *)(p) = (word_t)(val))
+
+//Convert between a block pointer and the link word stored for it. Compact
+//builds store the offset from the heap base, with 0 for NULL; the base is
+//never a block, so no block has offset 0.
+#ifdef MM_COMPACT
+#define TO_LINK(base, ptr)    ((ptr) == NULL ? 0 : (word_t)((char *)(ptr) - (char *)(base)))
+#define FROM_LINK(base, off)  ((off) == 0 ? NULL : (char *)(base) + (off))
+#else
+#define TO_LINK(base, ptr)    ((word_t)(ptr))
+#define FROM_LINK(base, off)  ((char *)(off))
+#endif
+
+//Read and write a free list link in arena a
+#define GET_LINK(a, p)        FROM_LINK((a)->heap_lo, GET(p))
+#define PUT_LINK(a, p, ptr)   PUT((p), TO_LINK((a)->heap_lo, (ptr)))
+
+//Read and write a full pointer, for links kept outside the free lists
+#define GET_PTR(p)          (*(char **)(p))
+#define PUT_PTR(p, val)     (*(char **)(p) = (char *)(val))
 
 //Read in the block status fields
 #define GET_SIZE(p)         (GET(p) & ~0x7)
 #define GET_PREV_ALLOC(p)   (GET(p) & 0x2)
 #define GET_ALLOC(p)        (GET(p) & 0x1)
+#define GET_MMAPPED(p)      (GET(p) & 0x4)
+
+//Header bit of a block that has its own mapping. MMAP_HEADER bytes before
+//the payload sit the links of the list of live mappings and the length of
+//the mapping, which may not fit a header word. The mapping starts at the
+//page holding those bytes, a page before the base only for memalign.
+#define MMAPPED      0x4
+#define MMAP_HEADER  32
+#define MMAP_BASE(ptr)  ((char *)(ptr) - MMAP_HEADER)
+#define MMAP_START(base) ((char *)((uintptr_t)(base) & ~(uintptr_t)(page_size - 1)))
+#define MMAP_NEXT(base) ((char *)(base))
+#define MMAP_PREV(base) ((char *)(base) + sizeof(char *))
+#define MMAP_LEN(base)  (*(size_t *)((char *)(base) + 2 * sizeof(char *)))
 
 //Change significant block bits
 #define CHANGE_SIZE(p, val)  (PUT((p), PACK((val), GET_PREV_ALLOC(p), GET_ALLOC(p))))
@@ -58,142 +134,837 @@
 #define PREV_BLOCK(ptr)       ((char *)(ptr) - GET_SIZE(((char *)(ptr) - DWORD)))
 
 //Getter functions for the next and previous free lists.
-#define NEXT_FLIST_ADDRESS(ptr)       ((char *)GET(ptr))
-#define PREV_FLIST_ADDRESS(ptr)       ((char *)GET(PREV_ADDRESS(ptr)))
+#define NEXT_FLIST_ADDRESS(a, ptr)       GET_LINK((a), (ptr))
+#define PREV_FLIST_ADDRESS(a, ptr)       GET_LINK((a), PREV_ADDRESS(ptr))
 
 //Getter and setter functions for the first node of each free list
-#define GET_ROOT(heap, list)              ((char *)GET((heap) + ((list) * WSIZE)))
-#define SET_ROOT(heap, list, new_root)    (PUT((heap) + ((list) * WSIZE), (new_root)))
+#define GET_ROOT(a, list)              GET_LINK((a), (a)->free_start + ((list) * WSIZE))
+#define SET_ROOT(a, list, new_root)    PUT_LINK((a), (a)->free_start + ((list) * WSIZE), (new_root))
+
+//Getter and setter functions for the last node of each free list
+#define GET_TAIL(a, list)              GET_LINK((a), (a)->free_start + ((MAX_LISTS + (list)) * WSIZE))
+#define SET_TAIL(a, list, new_tail)    PUT_LINK((a), (a)->free_start + ((MAX_LISTS + (list)) * WSIZE), (new_tail))
+
+//Free blocks in sorted classes are also nodes of a per-class treap keyed by
+//size, then address. The child links follow the list links, so those
+//blocks need room for four links.
+#define TREE_LEFT(ptr)       ((char *)(ptr) + DWORD)
+#define TREE_RIGHT(ptr)      ((char *)(ptr) + DWORD + WSIZE)
+#define TREE_ROOT(a, list)   ((char *)&(a)->tree[(list)])
+#define TREE_BLOCK           (6 * WSIZE)	//Header, four links and footer
+
+//Free blocks in purgeable classes carry a word after the treap links that
+//is set once the pages inside the block have been given back to the OS.
+#define PURGE_MARK(ptr)      ((char *)(ptr) + 4 * WSIZE)
+
+//Offset of the prologue payload from the free list array, which holds a
+//root and a tail per list followed by the prologue header. Rounding it to
+//a DWORD puts every payload on a DWORD boundary, so the gap memalign cuts
+//in front of an aligned block is a whole number of DWORDs.
+#define PROLOGUE_OFFSET  ((2 * MAX_LISTS * WSIZE + WSIZE + DWORD - 1) & ~(DWORD - 1))
+
+//Candidates find_fit compares per class when pushing at either end
+#define DEFAULT_FIT_SCAN  8
+
+//Classes holding free blocks of this size and up are kept in size order,
+//indexed by a treap
+#define SORTED_MIN  (1<<16)
+
+//Purging. Free blocks of PURGE_MIN bytes and up are purgeable; an arena
+//holding more than its purge limit of them unpurged gives their pages
+//back until it is down to half the limit.
+#define PURGE_MIN    (1<<16)	//Smallest purgeable block
+#define PURGE_LIMIT  (1<<24)	//Default dirty purgeable bytes per arena
+#define DIRTY_SCAN   8		//Larger blocks find_fit tries for a dirty one
+
+//Huge page size heap extensions are rounded to when huge pages are on
+#define HUGE_PAGE    ((size_t)1<<21)
+
+//Quick bins for deferred coalescing hold exact sizes in DWORD steps
+#define QUICK_BINS    64
+
+//Link a queued cross-thread free holds until its pusher writes the real one
+#define REMOTE_PENDING  ((char *)1)
+
+//Heap walks. A walk of a large heap is split into ranges walked by threads.
+#define WALK_MAX    16			//Most threads one walk is split over
+#define WALK_MIN    ((size_t)1<<22)	//Fewest heap bytes worth a thread
+#define WALK_PROBE  4			//Headers a guessed range start must chain through
+
+//Heap files. A file opens with a heap_file header, and the pool heap fills
+//the rest of it.
+#define HEAP_FILE_MAGIC    0x70616568206d6dUL	//"mm heap"
+#define HEAP_FILE_VERSION  1
+#define HEAP_FILE_HEADER   ((sizeof(struct heap_file) + DWORD - 1) & ~(size_t)(DWORD - 1))
+
+//Arena layout. Arenas past the first are carved from aligned mappings.
+#define MAX_ARENAS    64		//Most arenas threads are spread over
+#define ARENA_SIZE    ((size_t)1<<30)	//Bytes reserved per mapped arena
+#define ARENA_HEADER  ((sizeof(struct arena) + DWORD - 1) & ~(size_t)(DWORD - 1))
+
+//NUMA placement. Mapped arena i is bound to node (i - 1) % numa_nodes.
+#define MAX_NODES     64		//Most nodes arenas are bound to
+#ifndef MPOL_DEFAULT
+#define MPOL_DEFAULT  0
+#endif
+#ifndef MPOL_BIND
+#define MPOL_BIND     2
+#endif
+#ifndef MPOL_MF_MOVE
+#define MPOL_MF_MOVE  (1<<1)
+#endif
+
+//Thread cache layout. Bins hold exact block sizes in DWORD steps.
+#define TCACHE_BINS   64	//Block sizes below TCACHE_BINS * DWORD are cached
+#define TCACHE_COUNT  16	//Default blocks held per bin
+#define TCACHE_BATCH  8		//Blocks taken from the heap per refill
+
+//Slab layout. Requests up to SLAB_MAX bytes are served from page-sized
+//runs of equal slots, carved from one region reserved on first use.
+#define SLAB_MAX          128			//Default largest slab request
+#define SLAB_CLASSES      8			//Slot sizes, see slab_sizes
+#define SLAB_RUN_SIZE     (1<<12)		//Bytes per run, runs are run aligned
+#define SLAB_REGION_SIZE  ((size_t)1<<30)	//Bytes reserved for all runs
+#define SLAB_MAP_WORDS    (SLAB_RUN_SIZE / 8 / 64)	//Free bitmap words per run
+
+//Default request size above which a block gets its own mapping
+#define MMAP_THRESHOLD    (1<<18)
+
+//Realloc copies at least this long bypass the cache
+#define NT_COPY_THRESHOLD (1<<20)
+
+//Statistics builds count allocator events in each thread's cache, or in a
+//shared slot for threads whose cache is not registered yet, as on the pool
+//heap and sized free paths. Other builds compile the counters out.
+#ifdef MM_STATS
+#define STAT_ADD(field, n) \
+	(tcache.registered ? (void)(tcache.stats.field += (n)) \
+	                   : (void)__atomic_fetch_add(&stats_shared.field, (n), __ATOMIC_RELAXED))
+#else
+#define STAT_ADD(field, n)  ((void)0)
+#endif
+
+//Trace builds log every call to a ring of TRACE_EVENTS events.
+#define TRACE_EVENTS  (1<<16)
+#ifdef MM_TRACE
+#define TRACE(op, ptr, old, size)  trace_event((op), (ptr), (old), (size))
+#else
+#define TRACE(op, ptr, old, size)  ((void)0)
+#endif
+
+//Debug builds check the whole heap on every operation by default
+#ifdef MM_DEBUG
+#define CHECK_EVERY  1
+#else
+#define CHECK_EVERY  0
+#endif
+
+//Gets the run a slab slot lives in.
+#define SLAB_RUN(ptr)     ((struct slab_run *)((uintptr_t)(ptr) & ~(uintptr_t)(SLAB_RUN_SIZE - 1)))
+
+//An independent heap with its own free lists and lock. Arena 0 grows
+//through mem_sbrk; the others live in their own ARENA_SIZE aligned mapping
+//with the arena at its base, so any block maps back to its arena.
+struct arena {
+	pthread_mutex_t lock;		//Held for every operation on this heap
+	char *free_start;		//Pointer to array of free list starts
+	char *heap_prologue; 		//Prologue header pointer
+	char *heap_epilogue; 		//Epilogue header pointer
+	char *heap_lo;			//First byte of the heap
+	char *heap_brk;			//One past the last byte of the heap
+	char *heap_limit;		//End of the mapping, NULL for mem_sbrk
+	char *zero_lo;			//Mapped heap bytes from here on are still zero
+	int hugetlb;			//Mapping is backed by hugetlbfs pages
+	int pool;			//Heap lives in caller memory, see mm_heap_create
+	char *file;			//Mapping of a heap file, see mm_heap_open
+	size_t file_len;		//Bytes in that mapping
+	size_t root;			//Offset of the caller's root block, 0 for none
+	int node;			//NUMA node the heap is bound to, -1 for none
+	size_t release_align;		//Granule trims and purges give pages back in
+
+	//Two-level index of non-empty lists: bit fl of fl_bitmap is set when
+	//any list in first level fl is non-empty, bit sl of sl_bitmap[fl] when
+	//list (fl << SL_SHIFT) | sl is.
+	unsigned int fl_bitmap;
+	unsigned char sl_bitmap[FL_COUNT];
+	word_t tree[MAX_LISTS];		//Treap root links of the sorted lists
+
+	size_t grow;			//Bytes the next heap extension asks for
+	unsigned long mallocs;		//heap_malloc calls so far
+	unsigned long last_miss;	//mallocs at the last heap extension
+	size_t trim_size;		//Trailing free block size at the last trim
+
+	//Deferred coalescing. Freed blocks wait in quick, one bin per exact
+	//size, still marked allocated, until a miss or defer_limit flushes them.
+	char *quick[QUICK_BINS];
+	int quick_count;		//Blocks waiting in quick
+	unsigned long defer_frees;	//Frees that were deferred
+	unsigned long defer_hits;	//Mallocs served from quick
+	unsigned long defer_flushes;	//Batches coalesced
+	unsigned long defer_flushed;	//Blocks coalesced in batches
+
+	unsigned long ops;		//heap_malloc and heap_free calls, for sampling
+
+	//Blocks freed by threads that do not own the arena, pushed without the
+	//lock and linked through their first payload word like quick bins.
+	char *remote;
+	unsigned long remote_drains;	//Batches of queued frees drained
+	unsigned long remote_drained;	//Queued frees drained
+
+	size_t dirty_bytes;		//Bytes in unpurged purgeable free blocks
+	unsigned long purges;		//Blocks purged
+	size_t purged_bytes;		//Bytes given back by purging
+};
+
+static struct arena main_arena = { .lock = PTHREAD_MUTEX_INITIALIZER, .node = -1 };
+static struct arena *arenas[MAX_ARENAS] = { &main_arena };
+static int arena_count;		//Arenas threads are spread over
+static unsigned int next_arena;	//Round-robin counter for new threads
+static int numa_on;		//Arenas bound to nodes, threads to their node's
+static int remote_queue;	//Frees into other threads' arenas are queued
+static int numa_nodes;		//Nodes arenas are spread over
+static unsigned int next_node_arena[MAX_NODES];	//Per-node round-robin counters
+
+//Arena creation and mm_init run under arena_lock.
+static pthread_mutex_t arena_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long heap_generation;	//Bumped by every mm_init
+
+static int insert_policy;	//How add_block orders each free list
+static int fit_scan;		//Fitting candidates find_fit compares per class
+static int sorted_from;		//Lists from this one on are sorted by size
+static size_t split_min[MAX_LISTS];	//Leftover a request's class splits off
+static size_t high_min;		//Requests placed at the high end of a block
+static int purge_from;		//Lists from this one on are purgeable
+static size_t purge_limit;	//Dirty purgeable bytes an arena may hold
+static int huge_pages;		//MM_HUGE_* backing for the heaps
+static int tcache_limit;	//Blocks a thread caches per bin, 0 or less is off
+static int defer_limit;		//Blocks an arena defers, 0 coalesces at once
+static int walk_threads;	//Threads a heap walk is split over, 0 = one per CPU
+static int check_every;		//Heap operations between sampled checks, 0 = never
+static int check_level;		//MM_CHECK_* level of the sampled checks
+
+//Per-thread cache of freed blocks, one singly linked bin per block size.
+//Cached blocks stay marked allocated in the heap and are linked through
+//their first payload word.
+struct tcache {
+	unsigned long generation;	//heap_generation the bins belong to
+	int registered;			//Exit destructor installed
+	struct arena *arena;		//Arena this thread allocates from
+	int count[TCACHE_BINS];
+	char *bin[TCACHE_BINS];
+#ifdef MM_STATS
+	struct tcache *next;		//Registered threads, for mm_stats
+	struct tcache *prev;
+	struct mm_stats stats;		//This thread's counters
+#endif
+};
+
+static __thread struct tcache tcache;
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
+
+#ifdef MM_STATS
+typedef char stats_lists_match[(MM_STAT_LISTS == MAX_LISTS) ? 1 : -1];
+static struct tcache *stats_threads;	//Threads whose counters are live
+static struct mm_stats stats_retired;	//Counters of threads that exited
+static struct mm_stats stats_shared;	//Counters of threads with no registered cache
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+#ifdef MM_TRACE
+//One traced call. Reallocs keep the old pointer; allocations keep NULL.
+struct trace_event {
+	unsigned long long ns;		//CLOCK_MONOTONIC time of the call
+	char op;			//'m' allocate, 'f' free, 'r' realloc
+	void *ptr;
+	void *old;
+	size_t size;
+};
+
+static struct trace_event trace_ring[TRACE_EVENTS];
+static unsigned long trace_next;	//Events logged so far
+#endif
+
+//Start of a heap file. base is where the file was last mapped; the arena
+//pointers are relative to it until the file is mapped again.
+struct heap_file {
+	unsigned long magic;		//HEAP_FILE_MAGIC
+	unsigned int version;		//HEAP_FILE_VERSION
+	unsigned int layout;		//heap_layout of the last writer
+	char *base;			//Address of the last mapping
+	int clean;			//Closed by mm_heap_close since last opened
+};
+
+//One range of a heap walk: the blocks whose headers lie in [lo, hi). start
+//is first guessed by the range's thread and then chained from the block
+//before it, so the work on a range only ever sees real block boundaries.
+struct walk_range {
+	struct heap_walk *w;
+	char *lo;
+	char *hi;
+	char *start;			//First block of the range
+	char *end;			//First block of the next range
+	int prev_free;			//Block before start is free
+	int last_free;			//Block before end is free
+	int failed;			//Guessed walk met a bad header
+	char *bad;			//Block with that header
+	int errors;			//What the work on the range returned
+	unsigned long blocks;		//Blocks the work counted
+	size_t bytes;			//Bytes in them
+	char *head[MAX_LISTS];		//Free blocks the work listed, per class
+	char *tail[MAX_LISTS];
+};
+
+//A heap walk over one arena. fn is the work run on every chained range, in
+//parallel, with the arena lock held by the walker.
+struct heap_walk {
+	struct arena *a;
+	char *top;			//No block may end past this
+	char *first;			//Block after the prologue
+	int (*fn)(struct heap_walk *w, struct walk_range *r);
+	int chained;			//Ranges are chained, so threads run fn
+	int count;			//Ranges in use
+	char *bad;			//Block whose header stopped the walk
+	struct walk_range range[WALK_MAX];
+};
+
+//Header at the base of every slab run. Slots carry no header of their own;
+//a slot's run is found by masking its address.
+struct slab_run {
+	struct slab_run *next;		//Next run in the class's partial list
+	struct slab_run *prev;		//Previous run in the class's partial list
+	unsigned int slab_class;	//Index into slab_sizes
+	unsigned int slots;		//Slots in the run
+	unsigned int used;		//Allocated slots
+	unsigned int first;		//Offset of the first slot from the run
+	uint64_t free_map[SLAB_MAP_WORDS];	//Set bits mark free slots
+};
+
+//Runs of one slot size that still have a free slot.
+struct slab_class {
+	pthread_mutex_t lock;
+	struct slab_run *partial;
+};
+
+static const unsigned int slab_sizes[SLAB_CLASSES] = {
+	8, 16, 24, 32, 48, 64, 96, 128
+};
+
+//Slab class for each request size, indexed by the size in 8-byte words.
+static const unsigned char slab_class_of[(SLAB_MAX >> 3) + 1] = {
+	0, 0, 1, 2, 3, 4, 4, 5, 5, 6, 6, 6, 6, 7, 7, 7, 7
+};
+
+static struct slab_class slab_classes[SLAB_CLASSES] = {
+	[0 ... SLAB_CLASSES - 1] = { .lock = PTHREAD_MUTEX_INITIALIZER }
+};
+static char *slab_lo;			//Start of the slab region, NULL until used
+static char *slab_brk;			//Next unused run in the region
+static struct slab_run *slab_free_runs;	//Empty runs ready for any class
+static pthread_mutex_t slab_lock = PTHREAD_MUTEX_INITIALIZER;
+static int slab_max;			//Largest request served from slabs
+
+static size_t mmap_threshold;	//Requests above this get their own mapping
+static size_t grow_max;		//Largest heap extension
+static size_t trim_threshold;	//Trailing free bytes that trigger a trim
+static size_t page_size;
+static char *mmap_list;		//Base of the newest live mapping, for mm_init
+static size_t mmap_bytes;	//Bytes in live mappings
+static pthread_mutex_t mmap_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//Precomputed classes for sizes below SMALL_LIST_LIMIT, indexed by size/16.
+//Sizes below 1<<FL_SHIFT get one class per 16 bytes.
+static const unsigned char small_list[SMALL_LIST_LIMIT >> 4] = {
+	 0,  1,  2,  3,  4,  5,  6,  7,  8,  8,  9,  9, 10, 10, 11, 11,
+	12, 12, 12, 12, 13, 13, 13, 13, 14, 14, 14, 14, 15, 15, 15, 15,
+	16, 16, 16, 16, 16, 16, 16, 16, 17, 17, 17, 17, 17, 17, 17, 17,
+	18, 18, 18, 18, 18, 18, 18, 18, 19, 19, 19, 19, 19, 19, 19, 19
+};
+
+//Gets the relevant list based on the size of the block. Small sizes come
+//from the table, larger ones from the position of the highest set bit
+//(first level) and the SL_SHIFT bits below it (second level).
+static inline int get_list(size_t size)
+{
+	int msb;
+	int list;
+
+	if(size < SMALL_LIST_LIMIT){
+		return small_list[size >> 4];
+	}
+	msb = (int)(sizeof(unsigned long) * 8 - 1) - __builtin_clzl(size);
+	list = ((msb - FL_SHIFT + 1) << SL_SHIFT) |
+	       (int)((size >> (msb - SL_SHIFT)) & (SL_COUNT - 1));
+	return (list < MAX_LISTS) ? list : (MAX_LISTS - 1);
+}
+
+//Gets the smallest block size a list holds, the inverse of get_list.
+static size_t list_min(int list)
+{
+	int msb;
+	size_t i;
+
+	if(list < get_list(SMALL_LIST_LIMIT))
+		{
+			for(i = 0; small_list[i] != list; i++);
+			return MAX(i << 4, MIN_BLOCK);
+		}
+	msb = (list >> SL_SHIFT) + FL_SHIFT - 1;
+	return ((size_t)1 << msb) + ((size_t)(list & (SL_COUNT - 1)) << (msb - SL_SHIFT));
+}
+
+//Marks a list as non-empty or empty in the bitmap index.
+static inline void set_list_bit(struct arena *a, int list)
+{
+	a->sl_bitmap[list >> SL_SHIFT] |= (1 << (list & (SL_COUNT - 1)));
+	a->fl_bitmap |= (1U << (list >> SL_SHIFT));
+}
+
+static inline void clear_list_bit(struct arena *a, int list)
+{
+	a->sl_bitmap[list >> SL_SHIFT] &= ~(1 << (list & (SL_COUNT - 1)));
+	if(a->sl_bitmap[list >> SL_SHIFT] == 0){
+		a->fl_bitmap &= ~(1U << (list >> SL_SHIFT));
+  }
+}
 
-static void * heap_start;	//Pointer to heap start
-static void * free_start;	//Pointer to array of free list starts
-static void * heap_prologue; 	//Prologue header pointer
-static void * heap_epilogue; 	//Epilogue header pointer
+//Gets the first non-empty list at or above list, or -1 if there is none.
+static inline int find_list(struct arena *a, int list)
+{
+	int fl;
+	unsigned int sl_map;
+	unsigned int fl_map;
+
+	if(list >= MAX_LISTS){
+		return -1;
+  }
+	fl = list >> SL_SHIFT;
+	sl_map = a->sl_bitmap[fl] & (~0U << (list & (SL_COUNT - 1)));
+	if(sl_map == 0)
+		{
+			fl_map = a->fl_bitmap & (~0U << (fl + 1));
+			if(fl_map == 0){
+				return -1;
+      }
+			fl = __builtin_ctz(fl_map);
+			sl_map = a->sl_bitmap[fl];
+		}
+	return (fl << SL_SHIFT) | __builtin_ctz(sl_map);
+}
 
 // Relevant helper functions
-static int get_list(size_t size);
-static void *find_fit(size_t size);
-static void add_block(void *ptr);
-static void remove_block(void *ptr);
-static void *coalesce(void *ptr);
-static void *extend_heap(size_t words);
-static void *place(void *ptr, size_t size);
+static void *scan_list(struct arena *a, int list_num, size_t size);
+static void *find_fit(struct arena *a, size_t size);
+static void add_block(struct arena *a, void *ptr);
+static void add_sorted(struct arena *a, int list_num, char *ptr);
+static void tree_remove(struct arena *a, int list_num, char *ptr);
+static char *tree_fit(struct arena *a, int list_num, size_t size);
+static void remove_block(struct arena *a, void *ptr);
+static void *coalesce(struct arena *a, void *ptr);
+static void *extend_heap(struct arena *a, size_t words);
+static void *place(struct arena *a, void *ptr, size_t size);
+static void *place_fit(struct arena *a, char *ptr, size_t size);
+static int heap_init(const struct mm_options *opts);
+static size_t adjust_size(size_t size);
+static void *heap_malloc(struct arena *a, size_t size);
+static void heap_free(struct arena *a, void *ptr);
+static void arena_free(struct arena *a, void *ptr);
+static void remote_push(struct arena *a, char *ptr);
+static void remote_drain(struct arena *a);
+static void quick_flush(struct arena *a);
+static size_t heap_carve(struct arena *a, char *ptr, size_t size, size_t n, void **out);
+static size_t heap_malloc_batch(struct arena *a, size_t size, size_t n, void **out);
+static int ptr_compare(const void *x, const void *y);
+static void heap_touch(struct arena *a, char *ptr);
+static void * heap_calloc(struct arena *a, size_t size, size_t len, size_t *dirty);
+static void clear_block(void *dst, size_t len);
+static void * heap_memalign(struct arena *a, size_t align, size_t size);
+static int check_fail(struct arena *a, const void *ptr, const char *msg);
+static int check_lists(struct arena *a, int level, unsigned long *free_count);
+static int check_blocks(struct arena *a, unsigned long *free_count);
+static int arena_check(struct arena *a, int level);
+static void arena_sample(struct arena *a);
+static void * malloc_any(size_t size);
+static void free_any(void *ptr);
+static void * calloc_any(size_t n, size_t size);
+static void * realloc_any(void *ptr, size_t size);
+#ifdef MM_STATS
+static void stats_add(struct mm_stats *sum, const struct mm_stats *part);
+#endif
+#ifdef MM_TRACE
+static void trace_event(char op, void *ptr, void *old, size_t size);
+#endif
+static void free_block(void *ptr, size_t size);
+static void *heap_realloc(struct arena *a, void *ptr, size_t size);
+static void realloc_split(struct arena *a, void *ptr, size_t size);
+static struct tcache *tcache_get(void);
+static void tcache_flush(struct tcache *tc, int bin, int keep);
+static void *tcache_refill(struct tcache *tc, struct arena *a, size_t size);
+static void *arena_sbrk(struct arena *a, size_t size);
+static size_t huge_round(struct arena *a, size_t size);
+static void slab_init(void);
+static void *slab_malloc(size_t size);
+static void slab_free(void *ptr);
+static void *mmap_malloc(size_t size);
+static void *mmap_memalign(size_t align, size_t size);
+static void *mmap_realloc(void *ptr, size_t size);
+static void mmap_free(void *ptr);
+static size_t payload_size(void *ptr);
+static void copy_block(void *dst, const void *src, size_t len);
+static size_t arena_grow(struct arena *a);
+static void arena_trim(struct arena *a, char *ptr);
+
+//Gets a treap node's priority, a hash of its offset in the heap, so the
+//tree shape is random without storing anything in the block and survives
+//a heap file being mapped elsewhere.
+static inline uint32_t tree_priority(const struct arena *a, const char *ptr)
+{
+	return (uint32_t)((uintptr_t)(ptr - a->heap_lo) >> 3) * 2654435761U;
+}
+
+//Orders treap nodes by size, then address.
+static inline int tree_less(const char *x, const char *y)
+{
+	size_t x_size = GET_SIZE(HDRP(x));
+	size_t y_size = GET_SIZE(HDRP(y));
+
+	return x_size < y_size || (x_size == y_size && x < y);
+}
+
+//Unlinks ptr from its class's treap by merging its two subtrees into the
+//slot that held it.
+static void tree_remove(struct arena *a, int list_num, char *ptr)
+{
+	char *slot = TREE_ROOT(a, list_num);
+	char *node;
+	char *left;
+	char *right;
+
+	while((node = GET_LINK(a, slot)) != ptr)
+		{
+			slot = tree_less(node, ptr) ? TREE_RIGHT(node) : TREE_LEFT(node);
+		}
+	left = GET_LINK(a, TREE_LEFT(ptr));
+	right = GET_LINK(a, TREE_RIGHT(ptr));
+	while(left != NULL && right != NULL)
+		{
+			if(tree_priority(a, left) >= tree_priority(a, right))
+				{
+					PUT_LINK(a, slot, left);
+					slot = TREE_RIGHT(left);
+					left = GET_LINK(a, slot);
+				}
+			else
+				{
+					PUT_LINK(a, slot, right);
+					slot = TREE_LEFT(right);
+					right = GET_LINK(a, slot);
+				}
+		}
+	PUT_LINK(a, slot, (left != NULL) ? left : right);
+}
 
-//Gets the relevant list based on the size of the block.
-static int get_list(size_t size)
+//Gets the smallest block of at least size bytes in a sorted class, the
+//lowest addressed one on a tie, or NULL.
+static char * tree_fit(struct arena *a, int list_num, size_t size)
 {
-	short list_check = 0;
-	while((size > 0) && (list_check < (MAX_LISTS-1)))
+	char *node = GET_LINK(a, TREE_ROOT(a, list_num));
+	char *best = NULL;
+
+	while(node != NULL)
 		{
-			size = size & ~(1<<list_check);
-			list_check++;
+			STAT_ADD(probes[get_list(size)], 1);
+			if(GET_SIZE(HDRP(node)) >= size)
+				{
+					best = node;
+					node = GET_LINK(a, TREE_LEFT(node));
+				}
+			else
+				{
+					node = GET_LINK(a, TREE_RIGHT(node));
+				}
 		}
-	return list_check;
+	return best;
 }
+
 //Removes the node from the free list and updates neighboring nodes.
-static void remove_block(void *ptr)
+static void remove_block(struct arena *a, void *ptr)
 {
   char *next_node;
   char *prev_node;
 
 	int list_num = get_list(GET_SIZE(HDRP(ptr)));
-	prev_node = PREV_FLIST_ADDRESS(ptr);
-	next_node = NEXT_FLIST_ADDRESS(ptr);
+	if(list_num >= sorted_from){
+		tree_remove(a, list_num, ptr);
+  }
+	if(list_num >= purge_from && GET(PURGE_MARK(ptr)) == 0){
+		a->dirty_bytes -= GET_SIZE(HDRP(ptr));
+  }
+	prev_node = PREV_FLIST_ADDRESS(a, ptr);
+	next_node = NEXT_FLIST_ADDRESS(a, ptr);
   //Case 1: Pointer is the only node in the list.
 	if((prev_node == NULL) && (next_node == NULL))
 		{
-			SET_ROOT(free_start, list_num, NULL);
+			SET_ROOT(a, list_num, NULL);
+			SET_TAIL(a, list_num, NULL);
+			clear_list_bit(a, list_num);
 		}
   //Case 2: Pointer is the last node in the list.
 	else if(next_node == NULL)
 		{
-			PUT(NEXT_ADDRESS(prev_node), NULL);
+			PUT_LINK(a, NEXT_ADDRESS(prev_node), NULL);
+			SET_TAIL(a, list_num, prev_node);
 		}
   //Case 3: Pointer is the first node in the list.
   else if(prev_node == NULL)
   	{
-  		SET_ROOT(free_start, list_num, next_node);
-  		PUT(PREV_ADDRESS(next_node), NULL);
+  		SET_ROOT(a, list_num, next_node);
+  		PUT_LINK(a, PREV_ADDRESS(next_node), NULL);
   	}
   //Case 4: Pointer is a middle node being removed.
 	else
 		{
-      PUT(PREV_ADDRESS(next_node), prev_node);
-			PUT(NEXT_ADDRESS(prev_node), next_node);
+      PUT_LINK(a, PREV_ADDRESS(next_node), prev_node);
+			PUT_LINK(a, NEXT_ADDRESS(prev_node), next_node);
 		}
 	//Set current block to null.
-  PUT(PREV_ADDRESS(ptr), NULL);
-	PUT(NEXT_ADDRESS(ptr), NULL);
+  PUT_LINK(a, PREV_ADDRESS(ptr), NULL);
+	PUT_LINK(a, NEXT_ADDRESS(ptr), NULL);
 }
 
 //Helper function for adding a new block
-static void add_block(void *ptr)
+static void add_block(struct arena *a, void *ptr)
 {
 	int list_num = get_list(GET_SIZE(HDRP(ptr)));
 	char* new_ptr = ptr;
 
-  PUT(NEXT_ADDRESS(ptr), NULL);
-	PUT(PREV_ADDRESS(ptr), NULL);
+  PUT_LINK(a, NEXT_ADDRESS(ptr), NULL);
+	PUT_LINK(a, PREV_ADDRESS(ptr), NULL);
 
-	char *root_trace = GET_ROOT(free_start, list_num);
+	//A new free block starts out dirty.
+	if(list_num >= purge_from)
+		{
+			PUT(PURGE_MARK(ptr), 0);
+			a->dirty_bytes += GET_SIZE(HDRP(ptr));
+		}
+	//Sorted classes keep the smallest block first, whatever the policy.
+	if(list_num >= sorted_from)
+		{
+			add_sorted(a, list_num, ptr);
+			return;
+		}
+	char *root_trace = GET_ROOT(a, list_num);
   //Case 1: list is empty
 	if(root_trace == NULL)
 		{
       //Set the root as the new block
-			SET_ROOT(free_start, list_num, ptr);
+			SET_ROOT(a, list_num, ptr);
+			SET_TAIL(a, list_num, ptr);
+			set_list_bit(a, list_num);
+			return;
+		}
+	//LIFO: push the new block in front of the root.
+	if(insert_policy == MM_INSERT_LIFO)
+		{
+			SET_ROOT(a, list_num, ptr);
+			PUT_LINK(a, NEXT_ADDRESS(ptr), root_trace);
+			PUT_LINK(a, PREV_ADDRESS(root_trace), ptr);
+			return;
+		}
+	//FIFO: append the new block after the tail.
+	if(insert_policy == MM_INSERT_FIFO)
+		{
+			root_trace = GET_TAIL(a, list_num);
+			SET_TAIL(a, list_num, ptr);
+			PUT_LINK(a, NEXT_ADDRESS(root_trace), ptr);
+			PUT_LINK(a, PREV_ADDRESS(ptr), root_trace);
 			return;
 		}
   //Case 2: Empty root node, but existing nodes in list.
 	else if(root_trace > new_ptr)
 		{
       //Set new block as root, point forward to old root.
-			SET_ROOT(free_start, list_num, ptr);
-			PUT(NEXT_ADDRESS(ptr), root_trace);
-			PUT(PREV_ADDRESS(root_trace), ptr);
+			SET_ROOT(a, list_num, ptr);
+			PUT_LINK(a, NEXT_ADDRESS(ptr), root_trace);
+			PUT_LINK(a, PREV_ADDRESS(root_trace), ptr);
 			return;
 		}
   //Case 3: Only root node exists.
-	else if(NEXT_FLIST_ADDRESS(root_trace) == NULL)
+	else if(NEXT_FLIST_ADDRESS(a, root_trace) == NULL)
 		{
       //Set new block as next address from root.
-      PUT(NEXT_ADDRESS(root_trace), ptr);
-			PUT(PREV_ADDRESS(ptr), root_trace);
+      PUT_LINK(a, NEXT_ADDRESS(root_trace), ptr);
+			PUT_LINK(a, PREV_ADDRESS(ptr), root_trace);
+			SET_TAIL(a, list_num, ptr);
 			return;
 		}
     //Iterate until we cannot find a next address or have surpassed pointer
-	while(root_trace < new_ptr && NEXT_FLIST_ADDRESS(root_trace) != NULL )
+	while(root_trace < new_ptr && NEXT_FLIST_ADDRESS(a, root_trace) != NULL )
 		{
-			root_trace = NEXT_FLIST_ADDRESS(root_trace);
+			root_trace = NEXT_FLIST_ADDRESS(a, root_trace);
 		}
-  char *next = NEXT_FLIST_ADDRESS(root_trace);
-	char *prev = PREV_FLIST_ADDRESS(root_trace);
+  char *next = NEXT_FLIST_ADDRESS(a, root_trace);
+	char *prev = PREV_FLIST_ADDRESS(a, root_trace);
   //Case 4: We reach the last node in the list.
 	if(next == NULL)
 		{
 			if(new_ptr <= root_trace)
 				{
-          PUT(PREV_ADDRESS(root_trace), new_ptr);
-          PUT(NEXT_ADDRESS(new_ptr), root_trace);
-          PUT(PREV_ADDRESS(new_ptr), prev);
-          PUT(NEXT_ADDRESS(prev), new_ptr);
+          PUT_LINK(a, PREV_ADDRESS(root_trace), new_ptr);
+          PUT_LINK(a, NEXT_ADDRESS(new_ptr), root_trace);
+          PUT_LINK(a, PREV_ADDRESS(new_ptr), prev);
+          PUT_LINK(a, NEXT_ADDRESS(prev), new_ptr);
 				}
 			else
 				{
-          PUT(NEXT_ADDRESS(root_trace), new_ptr);
-					PUT(PREV_ADDRESS(new_ptr), root_trace);
+          PUT_LINK(a, NEXT_ADDRESS(root_trace), new_ptr);
+					PUT_LINK(a, PREV_ADDRESS(new_ptr), root_trace);
+					SET_TAIL(a, list_num, new_ptr);
 				}
 		}
   //Case 5: We reach a middle node at some point
 	else
 		{
-			PUT(NEXT_ADDRESS(new_ptr), root_trace);
-			PUT(PREV_ADDRESS(new_ptr), prev);
-			PUT(NEXT_ADDRESS(prev), new_ptr);
-			PUT(PREV_ADDRESS(root_trace), new_ptr);
+			PUT_LINK(a, NEXT_ADDRESS(new_ptr), root_trace);
+			PUT_LINK(a, PREV_ADDRESS(new_ptr), prev);
+			PUT_LINK(a, NEXT_ADDRESS(prev), new_ptr);
+			PUT_LINK(a, PREV_ADDRESS(root_trace), new_ptr);
+		}
+}
+//Inserts a block into a list kept in size order, with ties in address
+//order, and into the class's treap. The treap finds the block's place in
+//the list, so neither insertion walks the list.
+static void add_sorted(struct arena *a, int list_num, char *ptr)
+{
+	uint32_t priority = tree_priority(a, ptr);
+	char *slot = TREE_ROOT(a, list_num);
+	char *node = GET_LINK(a, slot);
+	char *prev = NULL;
+	char *next;
+	char *left_slot;
+	char *right_slot;
+
+	//The largest smaller node is the block's predecessor in the list.
+	while(node != NULL)
+		{
+			if(tree_less(node, ptr))
+				{
+					prev = node;
+					node = GET_LINK(a, TREE_RIGHT(node));
+				}
+			else
+				{
+					node = GET_LINK(a, TREE_LEFT(node));
+				}
+		}
+	//Descend past the nodes of higher priority, then split the subtree found
+	//there around ptr into its left and right children.
+	while((node = GET_LINK(a, slot)) != NULL && tree_priority(a, node) >= priority)
+		{
+			slot = tree_less(node, ptr) ? TREE_RIGHT(node) : TREE_LEFT(node);
+		}
+	PUT_LINK(a, slot, ptr);
+	left_slot = TREE_LEFT(ptr);
+	right_slot = TREE_RIGHT(ptr);
+	while(node != NULL)
+		{
+			if(tree_less(node, ptr))
+				{
+					PUT_LINK(a, left_slot, node);
+					left_slot = TREE_RIGHT(node);
+					node = GET_LINK(a, left_slot);
+				}
+			else
+				{
+					PUT_LINK(a, right_slot, node);
+					right_slot = TREE_LEFT(node);
+					node = GET_LINK(a, right_slot);
+				}
+		}
+	PUT_LINK(a, left_slot, NULL);
+	PUT_LINK(a, right_slot, NULL);
+
+	next = (prev == NULL) ? GET_ROOT(a, list_num) : NEXT_FLIST_ADDRESS(a, prev);
+	PUT_LINK(a, NEXT_ADDRESS(ptr), next);
+	PUT_LINK(a, PREV_ADDRESS(ptr), prev);
+	if(prev == NULL){
+		SET_ROOT(a, list_num, ptr);
+  }
+	else{
+		PUT_LINK(a, NEXT_ADDRESS(prev), ptr);
+  }
+	if(next == NULL){
+		SET_TAIL(a, list_num, ptr);
+  }
+	else{
+		PUT_LINK(a, PREV_ADDRESS(next), ptr);
+  }
+	set_list_bit(a, list_num);
+}
+//Marks a listed purgeable block as purged.
+static void mark_purged(struct arena *a, char *ptr)
+{
+	if(get_list(GET_SIZE(HDRP(ptr))) >= purge_from && GET(PURGE_MARK(ptr)) == 0)
+		{
+			PUT(PURGE_MARK(ptr), 1);
+			a->dirty_bytes -= GET_SIZE(HDRP(ptr));
+		}
+}
+
+//Gives back the arena's pages wholly inside lo to hi, in whole huge
+//pages when the heap is on huge pages so they are not split. Returns the
+//bytes given back.
+static size_t arena_release(struct arena *a, char *lo, char *hi)
+{
+	uintptr_t mask = a->release_align - 1;
+
+	//Caller memory may be a file or shared mapping; leave its pages be.
+	if(a->pool){
+		return 0;
+  }
+	lo = (char *)(((uintptr_t)lo + mask) & ~mask);
+	hi = (char *)((uintptr_t)hi & ~mask);
+	if(hi <= lo || madvise(lo, hi - lo, MADV_DONTNEED) != 0){
+		return 0;
+  }
+	return hi - lo;
+}
+
+//Gives back the whole pages inside a listed free block, keeping the page
+//with its header, links and mark and the one with its footer.
+static void purge_block(struct arena *a, char *ptr)
+{
+	size_t len = arena_release(a, PURGE_MARK(ptr) + WSIZE, FTRP(ptr));
+
+	if(len > 0)
+		{
+			a->purges++;
+			a->purged_bytes += len;
+		}
+	mark_purged(a, ptr);
+}
+
+//Purges dirty blocks, largest classes first, until the arena holds half
+//its purge limit. Caller holds the arena lock.
+static void arena_purge(struct arena *a)
+{
+	int list;
+	char *ptr;
+
+	for(list = MAX_LISTS - 1; list >= purge_from && a->dirty_bytes > purge_limit / 2; list--)
+		{
+			for(ptr = GET_ROOT(a, list); ptr != NULL && a->dirty_bytes > purge_limit / 2;
+			    ptr = NEXT_FLIST_ADDRESS(a, ptr))
+				{
+					if(GET(PURGE_MARK(ptr)) == 0){
+						purge_block(a, ptr);
+          }
+				}
 		}
 }
+
 //Attempts to coalesces neighboring free blocks
-static void * coalesce(void * ptr)
+static void * coalesce(struct arena *a, void * ptr)
 {
   size_t list_num;
   size_t other_block_size;
@@ -212,16 +983,18 @@ static void * coalesce(void * ptr)
 	//Case 1: Next block is free, previous is not.
 	if(prev_block_alloc && !next_block_alloc)
 		{
+			STAT_ADD(coalesce[0], 1);
 			ptr_size += GET_SIZE(HDRP(next_block));
 
-			remove_block(next_block);
+			remove_block(a, next_block);
 			PUT(HDRP(ptr), PACK(ptr_size, 2, 0));
 			PUT(FTRP(ptr), PACK(ptr_size, 2, 0));
-			add_block(ptr);
+			add_block(a, ptr);
 		}
   //Case 2: previous block not allocated, next block is.
   else if(!prev_block_alloc && next_block_alloc)
     {
+      STAT_ADD(coalesce[1], 1);
       prev_block = PREV_BLOCK(ptr);
       other_block_size = GET_SIZE(HDRP(prev_block));
       ptr_size += other_block_size;
@@ -229,14 +1002,14 @@ static void * coalesce(void * ptr)
       list_num = get_list(other_block_size);
 
       //Remove from current list and add to new list if size
-      //category changes
-      if((1 << list_num) <=  ptr_size)
+      //category changes, or if the list is sorted by size
+      if(get_list(ptr_size) != (int)list_num || (int)list_num >= sorted_from)
         {
-          remove_block(prev_block);
+          remove_block(a, prev_block);
           ptr = prev_block;
           PUT(HDRP(ptr), PACK(ptr_size, 2, 0));
           PUT(FTRP(ptr), PACK(ptr_size, 2, 0));
-          add_block(ptr);
+          add_block(a, ptr);
           return ptr;
         }
       else //No size change no need to update list, just pointers
@@ -250,19 +1023,21 @@ static void * coalesce(void * ptr)
     //Case 3: Both blocks in use
   else if(prev_block_alloc && next_block_alloc)
   		{
-  			add_block(ptr);
+  			STAT_ADD(coalesce[2], 1);
+  			add_block(a, ptr);
   		}
 
 	//Case 4: Both blocks free
 	else
 		{
+			STAT_ADD(coalesce[3], 1);
 			prev_block = PREV_BLOCK(ptr);
-			remove_block(next_block);
+			remove_block(a, next_block);
 			ptr_size += GET_SIZE(HDRP(prev_block)) + GET_SIZE(HDRP(next_block));
 			list_num = get_list(GET_SIZE(HDRP(prev_block)));
 
 
-			if((1 << list_num) > ptr_size)
+			if(get_list(ptr_size) == (int)list_num && (int)list_num < sorted_from)
 				{
 					ptr = prev_block;
 					PUT(HDRP(ptr), PACK(ptr_size, 2, 0));
@@ -270,13 +1045,13 @@ static void * coalesce(void * ptr)
 					return ptr;
 				}
 			else{
-					remove_block(prev_block);
+					remove_block(a, prev_block);
 
 					ptr = prev_block;
 					PUT(HDRP(ptr), PACK(ptr_size, 2, 0));
 					PUT(FTRP(ptr), PACK(ptr_size, 2, 0));
 
-					add_block(ptr);
+					add_block(a, ptr);
 					}
 		}
 	return ptr;
@@ -285,64 +1060,114 @@ static void * coalesce(void * ptr)
 /*
  * Extend heap by the number of words necessary
  */
-static void * extend_heap(size_t words)
+static void * extend_heap(struct arena *a, size_t words)
 {
 	size_t size;
   char *ptr;
+	char *old_end;
   // Allocate even words for alignment
 	size = (words % 2) ? (words + 1) * WSIZE : words * WSIZE;
+	size = huge_round(a, size);
 	//Get allocation of status of last pre-epilogue block
-	size_t end_alloc = GET_PREV_ALLOC(heap_epilogue);
+	size_t end_alloc = GET_PREV_ALLOC(a->heap_epilogue);
 
-	if((long)(ptr = mem_sbrk(size)) == -1){
+	if((ptr = arena_sbrk(a, size)) == NULL){
 		return NULL;
   }
+	STAT_ADD(extend_calls, 1);
+	STAT_ADD(extend_bytes, size);
 	PUT(HDRP(ptr), PACK(size, end_alloc, 0));
 	PUT(FTRP(ptr), PACK(size, end_alloc, 0));
 	PUT(HDRP(NEXT_BLOCK(ptr)), PACK(0, 0, 1));
-	heap_epilogue = HDRP(NEXT_BLOCK(ptr));
+	a->heap_epilogue = HDRP(NEXT_BLOCK(ptr));
+	a->trim_size = 0;
 
 	//Add new block. If last block was free, coalesce first.
 	if(end_alloc)
 		{
-      add_block(ptr);
+      add_block(a, ptr);
 			return ptr;
 		}
 	else
 		{
-      return coalesce(ptr);
+			//The old footer and epilogue end up inside the merged block; clear
+			//them so fresh pages past zero_lo stay all zero.
+			old_end = HDRP(ptr);
+			ptr = coalesce(a, ptr);
+			PUT(old_end, 0);
+			PUT(old_end - WSIZE, 0);
+      return ptr;
 		}
 }
 
-//Searches all lists to find a fit for malloc
-static void * find_fit(size_t size)
+//Searches one list for a fit. The smallest of the first fit_scan fitting
+//blocks wins; a fit_scan of 1 is first fit. Sorted lists take the best
+//fit from their treap, or a slightly larger dirty block over a purged best
+//fit, which would fault its pages back in.
+static void * scan_list(struct arena *a, int list_num, size_t size)
 {
-	int list_num = get_list(size);
-	char *ptr;
+	int candidates = 0;
+	char *ptr = GET_ROOT(a, list_num);
+	char *best = NULL;
 
-	while(list_num < MAX_LISTS)
+	if(list_num >= sorted_from)
 		{
-			ptr = GET_ROOT(free_start, list_num);
-			while(ptr != NULL)
+			best = tree_fit(a, list_num, size);
+			if(best == NULL || list_num < purge_from){
+				return best;
+      }
+			for(ptr = best; ptr != NULL && candidates < DIRTY_SCAN; ptr = NEXT_FLIST_ADDRESS(a, ptr))
 				{
-					if(size <= GET_SIZE(HDRP(ptr))){
+					if(GET(PURGE_MARK(ptr)) == 0){
 						return ptr;
           }
-					ptr = NEXT_FLIST_ADDRESS(ptr);
+					candidates++;
+				}
+			return best;
+		}
+	while(ptr != NULL)
+		{
+			STAT_ADD(probes[get_list(size)], 1);
+			if(size <= GET_SIZE(HDRP(ptr)))
+				{
+					if(best == NULL || GET_SIZE(HDRP(ptr)) < GET_SIZE(HDRP(best))){
+						best = ptr;
+					}
+					if(GET_SIZE(HDRP(ptr)) == size || ++candidates >= fit_scan){
+						break;
+					}
 				}
-					list_num++;
+			ptr = NEXT_FLIST_ADDRESS(a, ptr);
 		}
-    return NULL;
+	return best;
+}
+
+//Finds a fit for malloc. Blocks in the size's own class may still be too
+//small, so that list is scanned; every block in a higher class fits, so the
+//bitmap index jumps straight to the first non-empty one.
+static void * find_fit(struct arena *a, size_t size)
+{
+	int list_num = get_list(size);
+	char *ptr;
+
+	if((ptr = scan_list(a, list_num, size)) != NULL){
+		return ptr;
+  }
+	if((list_num = find_list(a, list_num + 1)) < 0){
+		return NULL;
+  }
+	return scan_list(a, list_num, size);
 }
 
 /*
  * place - updates flags and headers and splits the block if needed
  */
-static void * place(void *ptr, size_t size)
+static void * place(struct arena *a, void *ptr, size_t size)
 {
   size_t old_size;
   size_t frag_count;
 	size_t next_block_size;
+	int purged;
   char *split_block;
 	char *next_block;
 
@@ -351,185 +1176,3037 @@ static void * place(void *ptr, size_t size)
 
 	old_size = GET_SIZE(HDRP(ptr));
 	frag_count = old_size - size;
+	purged = get_list(old_size) >= purge_from && GET(PURGE_MARK(ptr)) != 0;
 
-	remove_block(ptr);
+	//Allocating from the trailing block dirties pages a trim released.
+	if(HDRP(next_block) == a->heap_epilogue){
+		a->trim_size = 0;
+  }
+	remove_block(a, ptr);
   //If the fragmentation is bad, split the blocks.
-	if(frag_count > (1<<6))
+	if(frag_count > split_min[get_list(size)])
 		{
+			STAT_ADD(splits[get_list(size)], 1);
 			PUT(HDRP(next_block), PACK(next_block_size, 0, 1));
-			PUT(HDRP(ptr), PACK(size, 2, 1));
+			PUT(HDRP(ptr), PACK(size, GET_PREV_ALLOC(HDRP(ptr)), 1));
 			//Split the block and update headers
 			split_block = NEXT_BLOCK(ptr);
 			PUT(HDRP(split_block), PACK(frag_count, 2, 0));
 			PUT(FTRP(split_block), PACK(frag_count, 2, 0));
-			add_block(split_block);
+			add_block(a, split_block);
+			//The tail of a purged block is still purged.
+			if(purged){
+				mark_purged(a, split_block);
+      }
 		}
   //Case if the block does not need to be split
 	else
 		{
 			PUT(HDRP(next_block), PACK(next_block_size, 2, 1));
-			PUT(HDRP(ptr), PACK(old_size, 2, 1));
+			PUT(HDRP(ptr), PACK(old_size, GET_PREV_ALLOC(HDRP(ptr)), 1));
 		}
+	heap_touch(a, ptr);
 	return ptr;
 }
 
-/*
- * mm_init - Allocates memory to the heap and begins list of free lists.
- */
-int mm_init(void)
+//Places a malloc in the free block found for it. Requests of high_min
+//bytes and up take the high end and leave the leftover free below them,
+//so large blocks cluster away from the small long-lived ones packed at
+//the low ends. The trailing block is still cut from the front, keeping
+//its free end next to the epilogue for growth and trimming.
+static void * place_fit(struct arena *a, char *ptr, size_t size)
 {
-	//Verify memory allocation
-	if((heap_prologue = mem_sbrk((MAX_LISTS + 3) * WSIZE)) == (void *)-1 ){
-		return -1;
-  }
-	//Set the start of the free list array to the beginning of the heap
-	free_start = heap_prologue;
-	heap_prologue += ((MAX_LISTS + 1) * WSIZE);
-  //Create word space.
-	int i = 0;
-	while(i < MAX_LISTS)
-		{
-			PUT(free_start + (i * WSIZE), NULL);
-			i++;
-		}
-	PUT(HDRP(heap_prologue), PACK(DWORD, 2, 1));
-	PUT(FTRP(heap_prologue), PACK(DWORD, 2, 1));
-	heap_epilogue = HDRP(NEXT_BLOCK(heap_prologue));
-	PUT(heap_epilogue, PACK(0, 2, 1));           /* Epilogue footer */
+	size_t frag_count = GET_SIZE(HDRP(ptr)) - size;
+	size_t prev_alloc = GET_PREV_ALLOC(HDRP(ptr));
+	int purged;
+	char *high;
 
-	if((heap_start = extend_heap(CHUNKSIZE/WSIZE)) == NULL){
-		return -1;
+	if(size < high_min || frag_count <= split_min[get_list(size)] ||
+	   HDRP(NEXT_BLOCK(ptr)) == a->heap_epilogue){
+		return place(a, ptr, size);
   }
-	return 0;
+	STAT_ADD(splits[get_list(size)], 1);
+	purged = get_list(GET_SIZE(HDRP(ptr))) >= purge_from && GET(PURGE_MARK(ptr)) != 0;
+	remove_block(a, ptr);
+	PUT(HDRP(ptr), PACK(frag_count, prev_alloc, 0));
+	PUT(FTRP(ptr), PACK(frag_count, prev_alloc, 0));
+	add_block(a, ptr);
+	if(purged){
+		mark_purged(a, ptr);
+  }
+	high = NEXT_BLOCK(ptr);
+	PUT(HDRP(high), PACK(size, 0, 1));
+	CHANGE_PREV(HDRP(NEXT_BLOCK(high)), 2);
+	heap_touch(a, high);
+	return high;
 }
 
-/*
- * mm_malloc - Increment the pointer by size to allocate a block.
- */
-void *mm_malloc(size_t size)
+//Marks the huge pages lo to hi touches for transparent huge pages, within
+//the arena's own range. The break sits just below a huge page boundary
+//after rounded extensions, so the page it is in gets marked ahead.
+static void arena_advise_huge(struct arena *a, char *lo, char *hi)
 {
-	if(size == 0){ //No point in allocating an empty block!
-		return NULL;
+#ifdef MADV_HUGEPAGE
+	char *start = (char *)((uintptr_t)a->heap_lo & ~(uintptr_t)(page_size - 1));
+
+	lo = (char *)((uintptr_t)lo & ~(uintptr_t)(HUGE_PAGE - 1));
+	hi = (char *)(((uintptr_t)hi + HUGE_PAGE - 1) & ~(uintptr_t)(HUGE_PAGE - 1));
+	lo = MAX(lo, start);
+	if(a->heap_limit != NULL){
+		hi = MIN(hi, a->heap_limit);
   }
-	size_t extend_size;
+	madvise(lo, hi - lo, MADV_HUGEPAGE);
+#else
+	(void)a;
+	(void)lo;
+	(void)hi;
+#endif
+}
+
+//Extends the arena's heap by size bytes, returning the old break or NULL.
+static void * arena_sbrk(struct arena *a, size_t size)
+{
 	char *ptr;
-  if(size <= 32) //32 bytes is our minimum block size. This verifies at least minimum
+
+	if(a->heap_limit == NULL)
 		{
-			size = 2 * 32;
+			//mem_sbrk takes an int, which would truncate a larger size.
+			if(size > INT_MAX){
+				return NULL;
+      }
+			if((long)(ptr = mem_sbrk(size)) == -1){
+				return NULL;
+      }
+			if(a->heap_lo == NULL){
+				a->heap_lo = ptr;
+      }
 		}
 	else
 		{
-			size = DWORD * ((size + (DWORD) + (DWORD-1)) / DWORD);
-		}
-
-	//Use find_fit helper function to find a free block
-	if((ptr = find_fit(size)) != NULL )
-		{
-			place(ptr, size);
-			return ptr;
+			if(size > (size_t)(a->heap_limit - a->heap_brk)){
+				return NULL;
+      }
+			ptr = a->heap_brk;
 		}
-	//If nothing is found, we will need to extend a current block.
-	extend_size = MAX(size, CHUNKSIZE);
-	if((ptr = extend_heap(extend_size/WSIZE)) == NULL ){
-		return NULL;
+	a->heap_brk = ptr + size;
+	//mem_sbrk makes no promise about what the new bytes hold.
+	if(a->heap_limit == NULL){
+		a->zero_lo = a->heap_brk;
+  }
+	//Ask for transparent huge pages over the extension.
+	if(huge_pages != MM_HUGE_NONE && !a->hugetlb && !a->pool){
+		arena_advise_huge(a, ptr, a->heap_brk);
   }
-	place(ptr, size);
 	return ptr;
 }
 
-/*
- * mm_free - Works via immediate coalescing.
- */
-void mm_free(void *ptr)
+//Rounds a heap extension up so the break lands on a huge page boundary
+//when huge pages are on, so each extension commits whole huge pages. An
+//extension that would then overrun the arena is left as it is.
+static size_t huge_round(struct arena *a, size_t size)
 {
-  size_t prev_block_alloc;
-  size_t next_block_size;
-  size_t next_block_alloc;
-	size_t ptr_size;
-	char *next_block;
-
-	ptr_size = GET_SIZE(HDRP(ptr));
-	next_block = NEXT_BLOCK(ptr);
-
-	prev_block_alloc = GET_PREV_ALLOC(HDRP(ptr));
-	next_block_size = GET_SIZE(HDRP(next_block));
-	next_block_alloc = GET_ALLOC(HDRP(next_block));
-
-	PUT(HDRP(ptr), PACK(ptr_size, prev_block_alloc, 0));
-	PUT(FTRP(ptr), PACK(ptr_size, prev_block_alloc, 0));
-	PUT(HDRP(next_block), PACK(next_block_size, 0, next_block_alloc));
+	uintptr_t end;
 
-	if(!next_block_alloc){
-		PUT(FTRP(next_block), PACK(next_block_size, 0, 0));
+	if(huge_pages == MM_HUGE_NONE){
+		return size;
+  }
+	end = ((uintptr_t)a->heap_brk + size + HUGE_PAGE - 1) & ~(uintptr_t)(HUGE_PAGE - 1);
+	if(a->heap_limit != NULL && end > (uintptr_t)a->heap_limit){
+		return size;
   }
-	coalesce(ptr); //After freeing, coalesce.
+	return (end - (uintptr_t)a->heap_brk) & ~(size_t)(DWORD - 1);
 }
-/*
- * mm_realloc - Implemented simply in terms of mm_malloc and mm_free
- */
-void *mm_realloc(void *ptr, size_t size)
-{
-	char *split_ptr;
 
-	if(ptr == NULL){
-		return mm_malloc(size);
-  }
-	if(size == 0)
+//Builds an empty heap in the arena: the free list array, the prologue and
+//epilogue, and a first free chunk.
+static int arena_init(struct arena *a)
+{
+	a->release_align = (huge_pages != MM_HUGE_NONE || a->hugetlb) ? HUGE_PAGE : page_size;
+	a->fl_bitmap = 0;
+	memset(a->sl_bitmap, 0, sizeof(a->sl_bitmap));
+	memset(a->tree, 0, sizeof(a->tree));
+	memset(a->quick, 0, sizeof(a->quick));
+	a->quick_count = 0;
+	a->defer_frees = 0;
+	a->defer_hits = 0;
+	a->defer_flushes = 0;
+	a->defer_flushed = 0;
+	a->ops = 0;
+	a->dirty_bytes = 0;
+	a->purges = 0;
+	a->purged_bytes = 0;
+	a->remote = NULL;
+	a->remote_drains = 0;
+	a->remote_drained = 0;
+	if(a->heap_limit == NULL)
 		{
-			mm_free(ptr);
-			return NULL;
+			a->heap_lo = NULL;
 		}
-
-	void *new_ptr = ptr;
+	else
+		{
+			//Give back the pages of the previous heap.
+			arena_release(a, a->heap_lo, a->heap_brk);
+			a->heap_brk = a->heap_lo;
+		}
+
+	//Verify memory allocation
+	if((a->heap_prologue = arena_sbrk(a, PROLOGUE_OFFSET + DWORD)) == NULL ){
+		return -1;
+  }
+	//Nothing is known about what caller memory holds.
+	a->zero_lo = a->pool ? a->heap_limit : a->heap_brk;
+	//Set the start of the free list array to the beginning of the heap
+	a->free_start = a->heap_prologue;
+	a->heap_prologue += PROLOGUE_OFFSET;
+  //Create word space for the list roots and tails.
+	int i = 0;
+	while(i < 2 * MAX_LISTS)
+		{
+			PUT(a->free_start + (i * WSIZE), 0);
+			i++;
+		}
+	PUT(HDRP(a->heap_prologue), PACK(DWORD, 2, 1));
+	PUT(FTRP(a->heap_prologue), PACK(DWORD, 2, 1));
+	a->heap_epilogue = HDRP(NEXT_BLOCK(a->heap_prologue));
+	PUT(a->heap_epilogue, PACK(0, 2, 1));           /* Epilogue footer */
+
+	a->grow = CHUNKSIZE;
+	a->mallocs = 0;
+	a->last_miss = 0;
+	if(extend_heap(a, CHUNKSIZE/WSIZE) == NULL){
+		return -1;
+  }
+	return 0;
+}
+
+//Gets the number of NUMA nodes the system has online, 1 without NUMA.
+static int numa_count(void)
+{
+	FILE *f;
+	int node;
+	int count = 1;
+	char sep;
+
+	if((f = fopen("/sys/devices/system/node/online", "r")) == NULL){
+		return 1;
+  }
+	//The list reads like 0-1 or 0,2-3, so the last number is the highest.
+	while(fscanf(f, "%d%c", &node, &sep) >= 1){
+		count = MAX(count, node + 1);
+  }
+	fclose(f);
+	return MIN(count, MAX_NODES);
+}
+
+//Sets the memory policy of len bytes at addr to node, or back to the
+//default for a node below 0. Pages already touched move only with flags
+//holding MPOL_MF_MOVE.
+static void numa_bind(void *addr, size_t len, int node, unsigned int flags)
+{
+	unsigned long mask = (node >= 0) ? 1UL << node : 0;
+
+	syscall(SYS_mbind, addr, len, (node >= 0) ? MPOL_BIND : MPOL_DEFAULT,
+	        (node >= 0) ? &mask : NULL, (node >= 0) ? MAX_NODES + 1 : 0, flags);
+}
+
+//Binds a mapped arena's whole reservation to node, -1 for none.
+static void arena_bind(struct arena *a, int node)
+{
+	if(a->node == node){
+		return;
+  }
+	numa_bind(a, ARENA_SIZE, node, 0);
+	a->node = node;
+}
+
+//Gets the node arena i is bound to, -1 for the main arena or without NUMA.
+static int arena_node(int i)
+{
+	return (numa_on && i > 0) ? (i - 1) % numa_nodes : -1;
+}
+
+//Gets the index of the k-th arena bound to node. Each node gets an equal
+//share of the arena_count - 1 mapped arenas.
+static int node_arena(int node, unsigned int k)
+{
+	int per_node = MAX(1, (arena_count - 1) / numa_nodes);
+
+	return 1 + node + (int)(k % per_node) * numa_nodes;
+}
+
+//Maps a new ARENA_SIZE aligned arena bound to node, -1 for none. Caller
+//holds arena_lock.
+static struct arena * arena_create(int node)
+{
+	char *map;
+	char *base;
+	struct arena *a;
+	int hugetlb;
+
+	//Over-map by ARENA_SIZE and trim so the arena starts on a boundary.
+	//hugetlbfs pages are reserved up front, so a short pool fails here
+	//rather than faulting later, and the arena falls back to normal pages.
+	map = MAP_FAILED;
+#ifdef MAP_HUGETLB
+	if(huge_pages == MM_HUGE_TLB){
+		map = mmap(NULL, 2 * ARENA_SIZE, PROT_READ | PROT_WRITE,
+		           MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  }
+#endif
+	hugetlb = (map != MAP_FAILED);
+	if(map == MAP_FAILED){
+		map = mmap(NULL, 2 * ARENA_SIZE, PROT_READ | PROT_WRITE,
+		           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  }
+	if(map == MAP_FAILED){
+		return NULL;
+  }
+	base = (char *)(((uintptr_t)map + ARENA_SIZE - 1) & ~(uintptr_t)(ARENA_SIZE - 1));
+	if(base > map){
+		munmap(map, base - map);
+  }
+	munmap(base + ARENA_SIZE, map + ARENA_SIZE - base);
+
+	a = (struct arena *)base;
+	pthread_mutex_init(&a->lock, NULL);
+	a->hugetlb = hugetlb;
+	a->node = -1;
+	arena_bind(a, node);
+	a->heap_lo = base + ARENA_HEADER;
+	a->heap_brk = a->heap_lo;
+	a->heap_limit = base + ARENA_SIZE;
+	if(arena_init(a) < 0)
+		{
+			munmap(base, ARENA_SIZE);
+			return NULL;
+		}
+	return a;
+}
+
+//Gets the arena a block belongs to.
+static inline struct arena * arena_of(void *ptr)
+{
+	if((char *)ptr >= main_arena.heap_lo && (char *)ptr < main_arena.heap_brk){
+		return &main_arena;
+  }
+	return (struct arena *)((uintptr_t)ptr & ~(uintptr_t)(ARENA_SIZE - 1));
+}
+
+//Picks an arena for a new thread, round-robin over arena_count arenas, or
+//over the arenas of the node the thread runs on with NUMA on. Falls back
+//to the main arena when a new one cannot be mapped.
+static struct arena * arena_assign(void)
+{
+	struct arena *a;
+	unsigned int cpu;
+	unsigned int node;
+	int i;
+
+	pthread_mutex_lock(&arena_lock);
+	if(numa_on && syscall(SYS_getcpu, &cpu, &node, NULL) == 0 && node < (unsigned int)numa_nodes){
+		i = node_arena(node, next_node_arena[node]++);
+  }
+	else{
+		i = next_arena++ % arena_count;
+  }
+	if(arenas[i] == NULL){
+		arenas[i] = arena_create(arena_node(i));
+  }
+	a = (arenas[i] != NULL) ? arenas[i] : &main_arena;
+	pthread_mutex_unlock(&arena_lock);
+	return a;
+}
+
+//Checks whether ptr is a slab slot rather than a boundary-tag block.
+static inline int is_slab(void *ptr)
+{
+	return slab_lo != NULL && (char *)ptr >= slab_lo &&
+	       (char *)ptr < slab_lo + SLAB_REGION_SIZE;
+}
+
+//Empties the slab region, keeping the reservation. Caller holds arena_lock.
+static void slab_init(void)
+{
+	int i;
+
+	pthread_mutex_lock(&slab_lock);
+	if(slab_lo != NULL && slab_brk > slab_lo){
+		madvise(slab_lo, slab_brk - slab_lo, MADV_DONTNEED);
+  }
+	slab_brk = slab_lo;
+	slab_free_runs = NULL;
+	pthread_mutex_unlock(&slab_lock);
+	for(i = 0; i < SLAB_CLASSES; i++)
+		{
+			slab_classes[i].partial = NULL;
+		}
+}
+
+//Gets an empty run and formats it for a slab class, or NULL when the
+//region is exhausted.
+static struct slab_run * slab_run_new(int slab_class)
+{
+	struct slab_run *run;
+	unsigned int slot = slab_sizes[slab_class];
+	unsigned int i;
+
+	pthread_mutex_lock(&slab_lock);
+	if(slab_lo == NULL)
+		{
+			slab_lo = mmap(NULL, SLAB_REGION_SIZE, PROT_READ | PROT_WRITE,
+			               MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+			if(slab_lo == MAP_FAILED)
+				{
+					slab_lo = NULL;
+					pthread_mutex_unlock(&slab_lock);
+					return NULL;
+				}
+			slab_brk = slab_lo;
+		}
+	if((run = slab_free_runs) != NULL)
+		{
+			slab_free_runs = run->next;
+		}
+	else if(slab_brk + SLAB_RUN_SIZE <= slab_lo + SLAB_REGION_SIZE)
+		{
+			run = (struct slab_run *)slab_brk;
+			slab_brk += SLAB_RUN_SIZE;
+		}
+	pthread_mutex_unlock(&slab_lock);
+	if(run == NULL){
+		return NULL;
+  }
+
+	run->next = NULL;
+	run->prev = NULL;
+	run->slab_class = slab_class;
+	run->first = (sizeof(struct slab_run) + DWORD - 1) & ~(DWORD - 1);
+	run->slots = (SLAB_RUN_SIZE - run->first) / slot;
+	run->used = 0;
+	memset(run->free_map, 0, sizeof(run->free_map));
+	for(i = 0; i < run->slots; i++)
+		{
+			run->free_map[i / 64] |= (uint64_t)1 << (i % 64);
+		}
+	return run;
+}
+
+//Allocates a slot for a request of at most slab_max bytes, or NULL when no
+//run can be had.
+static void * slab_malloc(size_t size)
+{
+	int slab_class = slab_class_of[(size + 7) >> 3];
+	struct slab_class *c = &slab_classes[slab_class];
+	struct slab_run *run;
+	unsigned int word;
+	unsigned int slot;
+
+	pthread_mutex_lock(&c->lock);
+	if((run = c->partial) == NULL)
+		{
+			if((run = slab_run_new(slab_class)) == NULL)
+				{
+					pthread_mutex_unlock(&c->lock);
+					return NULL;
+				}
+			c->partial = run;
+		}
+	for(word = 0; run->free_map[word] == 0; word++)
+		;
+	slot = word * 64 + __builtin_ctzll(run->free_map[word]);
+	run->free_map[word] &= run->free_map[word] - 1;
+	//A full run leaves the partial list until a slot is freed.
+	if(++run->used == run->slots)
+		{
+			c->partial = run->next;
+			if(run->next != NULL){
+				run->next->prev = NULL;
+      }
+			run->next = NULL;
+		}
+	pthread_mutex_unlock(&c->lock);
+	return (char *)run + run->first + (size_t)slot * slab_sizes[slab_class];
+}
+
+//Frees a slot. An empty run goes back to the region unless it is the only
+//partial run of its class.
+static void slab_free(void *ptr)
+{
+	struct slab_run *run = SLAB_RUN(ptr);
+	struct slab_class *c = &slab_classes[run->slab_class];
+	unsigned int slot;
+
+	pthread_mutex_lock(&c->lock);
+	slot = ((char *)ptr - (char *)run - run->first) / slab_sizes[run->slab_class];
+	run->free_map[slot / 64] |= (uint64_t)1 << (slot % 64);
+	if(run->used-- == run->slots)
+		{
+			run->prev = NULL;
+			run->next = c->partial;
+			if(c->partial != NULL){
+				c->partial->prev = run;
+      }
+			c->partial = run;
+		}
+	if(run->used == 0 && (run->prev != NULL || run->next != NULL))
+		{
+			if(run->prev != NULL){
+				run->prev->next = run->next;
+      }
+			else{
+				c->partial = run->next;
+      }
+			if(run->next != NULL){
+				run->next->prev = run->prev;
+      }
+			pthread_mutex_unlock(&c->lock);
+			pthread_mutex_lock(&slab_lock);
+			run->next = slab_free_runs;
+			slab_free_runs = run;
+			pthread_mutex_unlock(&slab_lock);
+			return;
+		}
+	pthread_mutex_unlock(&c->lock);
+}
+
+//Links a mapping into the list of live mappings. Caller holds mmap_lock.
+static void mmap_link(char *base)
+{
+	PUT_PTR(MMAP_NEXT(base), mmap_list);
+	PUT_PTR(MMAP_PREV(base), NULL);
+	mmap_bytes += MMAP_LEN(base);
+	if(mmap_list != NULL){
+		PUT_PTR(MMAP_PREV(mmap_list), base);
+  }
+	mmap_list = base;
+}
+
+//Unlinks a mapping from the list of live mappings. Caller holds mmap_lock.
+static void mmap_unlink(char *base)
+{
+	char *next = GET_PTR(MMAP_NEXT(base));
+	char *prev = GET_PTR(MMAP_PREV(base));
+
+	mmap_bytes -= MMAP_LEN(base);
+	if(prev != NULL){
+		PUT_PTR(MMAP_NEXT(prev), next);
+  }
+	else{
+		mmap_list = next;
+  }
+	if(next != NULL){
+		PUT_PTR(MMAP_PREV(next), prev);
+  }
+}
+
+//Gets a mapping of its own for a large request. The block header sits in
+//the word before the payload like any other block.
+static void * mmap_malloc(size_t size)
+{
+	size_t len = (size + MMAP_HEADER + page_size - 1) & ~(page_size - 1);
+	char *base;
+
+	base = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(base == MAP_FAILED){
+		return NULL;
+  }
+	MMAP_LEN(base) = len;
+	PUT(HDRP(base + MMAP_HEADER), PACK(0, MMAPPED, 1));
+	pthread_mutex_lock(&mmap_lock);
+	mmap_link(base);
+	pthread_mutex_unlock(&mmap_lock);
+	return base + MMAP_HEADER;
+}
+
+//Gets a mapping of its own for a large request at a multiple of align.
+//The mapping is made align bytes longer, and the pages before the one
+//holding the base and those after the payload are unmapped again.
+static void * mmap_memalign(size_t align, size_t size)
+{
+	size_t len = (size + MMAP_HEADER + align + page_size - 1) & ~(page_size - 1);
+	char *start;
+	char *end;
+	char *ptr;
+
+	start = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(start == MAP_FAILED){
+		return NULL;
+  }
+	ptr = (char *)(((uintptr_t)start + MMAP_HEADER + align - 1) & ~(uintptr_t)(align - 1));
+	end = (char *)(((uintptr_t)ptr + size + page_size - 1) & ~(uintptr_t)(page_size - 1));
+	if(MMAP_START(MMAP_BASE(ptr)) != start){
+		munmap(start, MMAP_START(MMAP_BASE(ptr)) - start);
+  }
+	if(end != start + len){
+		munmap(end, start + len - end);
+  }
+	MMAP_LEN(MMAP_BASE(ptr)) = end - MMAP_START(MMAP_BASE(ptr));
+	PUT(HDRP(ptr), PACK(0, MMAPPED, 1));
+	pthread_mutex_lock(&mmap_lock);
+	mmap_link(MMAP_BASE(ptr));
+	pthread_mutex_unlock(&mmap_lock);
+	return ptr;
+}
+
+//Resizes a mapped block with mremap, which can move it without copying.
+//The payload keeps its offset into the first page, not its alignment.
+static void * mmap_realloc(void *ptr, size_t size)
+{
+	char *start = MMAP_START(MMAP_BASE(ptr));
+	size_t offset = MMAP_BASE(ptr) - start;
+	size_t old_len = MMAP_LEN(MMAP_BASE(ptr));
+	size_t len = (size + offset + MMAP_HEADER + page_size - 1) & ~(page_size - 1);
+	char *base;
+
+	if(len == old_len){
+		return ptr;
+  }
+	pthread_mutex_lock(&mmap_lock);
+	mmap_unlink(MMAP_BASE(ptr));
+	base = mremap(start, old_len, len, MREMAP_MAYMOVE);
+	if(base == MAP_FAILED)
+		{
+			mmap_link(MMAP_BASE(ptr));
+			pthread_mutex_unlock(&mmap_lock);
+			return NULL;
+		}
+	base += offset;
+	MMAP_LEN(base) = len;
+	mmap_link(base);
+	pthread_mutex_unlock(&mmap_lock);
+	return base + MMAP_HEADER;
+}
+
+//Returns a mapped block to the OS.
+static void mmap_free(void *ptr)
+{
+	pthread_mutex_lock(&mmap_lock);
+	mmap_unlink(MMAP_BASE(ptr));
+	pthread_mutex_unlock(&mmap_lock);
+	munmap(MMAP_START(MMAP_BASE(ptr)), MMAP_LEN(MMAP_BASE(ptr)));
+}
+
+//Unmaps every live mapped block. Caller holds arena_lock.
+static void mmap_init(void)
+{
+	char *base;
+
+	pthread_mutex_lock(&mmap_lock);
+	while((base = mmap_list) != NULL)
+		{
+			mmap_list = GET_PTR(MMAP_NEXT(base));
+			munmap(MMAP_START(base), MMAP_LEN(base));
+		}
+	mmap_bytes = 0;
+	pthread_mutex_unlock(&mmap_lock);
+}
+
+//Gets the bytes a caller may use in an allocated block.
+static size_t payload_size(void *ptr)
+{
+	if(is_slab(ptr)){
+		return slab_sizes[SLAB_RUN(ptr)->slab_class];
+  }
+	if(GET_MMAPPED(HDRP(ptr))){
+		return MMAP_START(MMAP_BASE(ptr)) + MMAP_LEN(MMAP_BASE(ptr)) - (char *)ptr;
+  }
+	return GET_SIZE(HDRP(ptr)) - WSIZE;
+}
+
+//Copies a payload for realloc. Copies of NT_COPY_THRESHOLD bytes or more
+//use non-temporal stores, so relocating a huge buffer does not evict the
+//caller's working set from the cache.
+static void copy_block(void *dst, const void *src, size_t len)
+{
+#ifdef __SSE2__
+	char *d = dst;
+	const char *s = src;
+	size_t head;
+
+	if(len < NT_COPY_THRESHOLD)
+		{
+			memcpy(dst, src, len);
+			return;
+		}
+	//Align the destination, stream 64 bytes per step, then the tail.
+	head = (16 - ((uintptr_t)d & 15)) & 15;
+	memcpy(d, s, head);
+	d += head;
+	s += head;
+	len -= head;
+	while(len >= 64)
+		{
+			__m128i x0 = _mm_loadu_si128((const __m128i *)s);
+			__m128i x1 = _mm_loadu_si128((const __m128i *)(s + 16));
+			__m128i x2 = _mm_loadu_si128((const __m128i *)(s + 32));
+			__m128i x3 = _mm_loadu_si128((const __m128i *)(s + 48));
+			_mm_stream_si128((__m128i *)d, x0);
+			_mm_stream_si128((__m128i *)(d + 16), x1);
+			_mm_stream_si128((__m128i *)(d + 32), x2);
+			_mm_stream_si128((__m128i *)(d + 48), x3);
+			d += 64;
+			s += 64;
+			len -= 64;
+		}
+	_mm_sfence();
+	memcpy(d, s, len);
+#else
+	memcpy(dst, src, len);
+#endif
+}
+
+//Zeroes a payload for calloc. Clears of NT_COPY_THRESHOLD bytes or more
+//use non-temporal stores, as in copy_block.
+static void clear_block(void *dst, size_t len)
+{
+#ifdef __SSE2__
+	char *d = dst;
+	__m128i zero = _mm_setzero_si128();
+	size_t head;
+
+	if(len < NT_COPY_THRESHOLD)
+		{
+			memset(dst, 0, len);
+			return;
+		}
+	head = (16 - ((uintptr_t)d & 15)) & 15;
+	memset(d, 0, head);
+	d += head;
+	len -= head;
+	while(len >= 64)
+		{
+			_mm_stream_si128((__m128i *)d, zero);
+			_mm_stream_si128((__m128i *)(d + 16), zero);
+			_mm_stream_si128((__m128i *)(d + 32), zero);
+			_mm_stream_si128((__m128i *)(d + 48), zero);
+			d += 64;
+			len -= 64;
+		}
+	_mm_sfence();
+	memset(d, 0, len);
+#else
+	memset(dst, 0, len);
+#endif
+}
+
+//Follows blocks from ptr to the first one whose header is at or past hi,
+//or to a zero-size header, stepping over runs of touching free blocks so
+//no range starts inside one. last_free holds whether the block before ptr
+//is free on entry and the block before the result on return. Returns NULL,
+//with the block in *bad, at a header no block could have.
+static char *walk_span(const struct heap_walk *w, char *ptr, char *hi, int *last_free, char **bad)
+{
+	size_t size;
+
+	while((size = GET_SIZE(HDRP(ptr))) != 0 && (HDRP(ptr) < hi || (*last_free && !GET_ALLOC(HDRP(ptr)))))
+		{
+			if((size & (DWORD - 1)) || size < MIN_BLOCK || (size_t)(w->top - HDRP(ptr)) < size + WSIZE)
+				{
+					*bad = ptr;
+					return NULL;
+				}
+			*last_free = !GET_ALLOC(HDRP(ptr));
+			ptr += size;
+		}
+	return ptr;
+}
+
+//Guesses the first block whose header lies in [lo, hi): the first word,
+//placed like a payload, starting a chain of WALK_PROBE headers that look real, free ones with
+//matching footers and every prev-alloc bit agreeing with the block before.
+//Payload bytes rarely pass, and a wrong guess only costs a serial walk of
+//the range when it is chained. Returns NULL when no word passes.
+static char *walk_guess(const struct heap_walk *w, char *lo, char *hi)
+{
+	char *ptr = lo + WSIZE + (((uintptr_t)w->first - (uintptr_t)(lo + WSIZE)) & (DWORD - 1));
+	char *next;
+	size_t size;
+	int i;
+
+	for(; HDRP(ptr) < hi; ptr += DWORD)
+		{
+			next = ptr;
+			for(i = 0; i < WALK_PROBE; i++)
+				{
+					size = GET_SIZE(HDRP(next));
+					if(size == 0)
+						{
+							//Only an epilogue, still marked allocated, ends a chain early.
+							if(!GET_ALLOC(HDRP(next))){
+								break;
+              }
+							i = WALK_PROBE;
+							break;
+						}
+					if((size & (DWORD - 1)) || size < MIN_BLOCK || (size_t)(w->top - HDRP(next)) < size + WSIZE ||
+					   GET_MMAPPED(HDRP(next)) || (!GET_ALLOC(HDRP(next)) && GET(HDRP(next)) != GET(FTRP(next))) ||
+					   GET_PREV_ALLOC(HDRP(next + size)) != (GET_ALLOC(HDRP(next)) ? 2 : 0)){
+						break;
+          }
+					next += size;
+				}
+			if(i == WALK_PROBE){
+				return ptr;
+      }
+		}
+	return NULL;
+}
+
+//Runs one range's half of a walk: guessing and following its blocks
+//before the ranges are chained, the walk's work after.
+static void *walk_thread(void *arg)
+{
+	struct walk_range *r = arg;
+	struct heap_walk *w = r->w;
+
+	if(w->chained)
+		{
+			r->errors = w->fn(w, r);
+			return NULL;
+		}
+	if(r->start == NULL){
+		r->start = walk_guess(w, r->lo, r->hi);
+  }
+	if(r->start != NULL)
+		{
+			r->last_free = 0;
+			r->end = walk_span(w, r->start, r->hi, &r->last_free, &r->bad);
+			r->failed = (r->end == NULL);
+		}
+	return NULL;
+}
+
+//Runs walk_thread on every range, the first on the calling thread. A range
+//whose thread cannot be started runs here too.
+static void walk_run(struct heap_walk *w)
+{
+	pthread_t threads[WALK_MAX];
+	int started[WALK_MAX];
+	int i;
+
+	for(i = 1; i < w->count; i++){
+		started[i] = (pthread_create(&threads[i], NULL, walk_thread, &w->range[i]) == 0);
+  }
+	walk_thread(&w->range[0]);
+	for(i = 1; i < w->count; i++)
+		{
+			if(started[i]){
+				pthread_join(threads[i], NULL);
+      }
+			else{
+				walk_thread(&w->range[i]);
+      }
+		}
+}
+
+//Gets the number of ranges worth walking bytes of heap in.
+static int walk_count(size_t bytes)
+{
+	long n = (walk_threads > 0) ? walk_threads : sysconf(_SC_NPROCESSORS_ONLN);
+
+	n = MIN(n, WALK_MAX);
+	n = MIN(n, (long)(bytes / WALK_MIN));
+	return (n > 1) ? (int)n : 1;
+}
+
+//Walks every block of w->a from the first after the prologue up to a
+//zero-size header, running w->fn on each range of blocks. The heap is cut
+//into ranges one thread each, every thread guesses where the first block
+//of its range starts and follows headers to the next range, and the
+//guesses are then checked in order from the prologue, walking a range
+//again where its guess was wrong. Returns the block with the zero-size
+//header, or NULL, with the damaged block in w->bad, when a header cannot
+//be followed. Caller holds the arena lock.
+static char *heap_walk(struct heap_walk *w)
+{
+	struct walk_range *r;
+	char *ptr = w->first = NEXT_BLOCK(w->a->heap_prologue);
+	char *guess;
+	char *end;
+	size_t step;
+	int free_before = 0;
+	int last_free;
+	int i;
+
+	if(HDRP(ptr) >= w->top){
+		w->bad = ptr;
+		return NULL;
+  }
+	w->count = walk_count(w->top - HDRP(ptr));
+	step = ((size_t)(w->top - HDRP(ptr)) / w->count + DWORD - 1) & ~(size_t)(DWORD - 1);
+	w->chained = 0;
+	w->bad = NULL;
+	for(i = 0; i < w->count; i++)
+		{
+			r = &w->range[i];
+			memset(r, 0, sizeof(*r));
+			r->w = w;
+			r->lo = HDRP(ptr) + i * step;
+			r->hi = (i == w->count - 1) ? w->top : r->lo + step;
+		}
+	w->range[0].start = ptr;
+	walk_run(w);
+
+	//Chain the ranges: each starts at the block the one before stopped at.
+	for(i = 0; i < w->count; i++)
+		{
+			r = &w->range[i];
+			r->prev_free = free_before;
+			if(r->start != ptr)
+				{
+					guess = r->start;
+					end = NULL;
+					last_free = free_before;
+					if(guess != NULL && ptr < guess){
+						end = walk_span(w, ptr, HDRP(guess), &last_free, &w->bad);
+          }
+					r->start = ptr;
+					if(end == NULL || end != guess)
+						{
+							//The guess was no block; walk the whole range from here.
+							r->failed = 0;
+							r->last_free = free_before;
+							r->end = walk_span(w, ptr, r->hi, &r->last_free, &r->bad);
+							r->failed = (r->end == NULL);
+						}
+					else if(r->end == guess)
+						{
+							r->last_free = last_free;
+						}
+				}
+			if(r->failed)
+				{
+					w->bad = r->bad;
+					return NULL;
+				}
+			if(r->start == r->end){
+				r->last_free = free_before;
+      }
+			ptr = r->end;
+			free_before = r->last_free;
+		}
+	w->chained = 1;
+	walk_run(w);
+	return ptr;
+}
+
+//Reports one heap inconsistency and counts it.
+static int check_fail(struct arena *a, const void *ptr, const char *msg)
+{
+	fprintf(stderr, "mm_checkheap: arena %p, block %p: %s\n", (void *)a, ptr, msg);
+	return 1;
+}
+
+//Checks the treap under node: keys strictly between lo and hi (NULL for
+//no bound) and priorities no higher than the parent's. Counts the nodes
+//in count and returns the number of errors.
+static int check_tree(struct arena *a, int list, char *node, char *lo, char *hi,
+                      unsigned long *count, unsigned long limit)
+{
+	int errors = 0;
+	char *left;
+	char *right;
+
+	if(node == NULL){
+		return 0;
+  }
+	if(node <= a->heap_prologue || node >= a->heap_epilogue || ((uintptr_t)node & (ALIGNMENT - 1))){
+		return check_fail(a, node, "tree node outside the heap");
+  }
+	if(++*count > limit){
+		return check_fail(a, node, "tree has a cycle");
+  }
+	if(GET_ALLOC(HDRP(node)) || get_list(GET_SIZE(HDRP(node))) != list){
+		errors += check_fail(a, node, "tree node is not a free block of its class");
+  }
+	if((lo != NULL && !tree_less(lo, node)) || (hi != NULL && !tree_less(node, hi))){
+		errors += check_fail(a, node, "tree is out of size order");
+  }
+	left = GET_LINK(a, TREE_LEFT(node));
+	right = GET_LINK(a, TREE_RIGHT(node));
+	if((left != NULL && tree_priority(a, left) > tree_priority(a, node)) ||
+	   (right != NULL && tree_priority(a, right) > tree_priority(a, node))){
+		errors += check_fail(a, node, "tree child outranks its parent");
+  }
+	errors += check_tree(a, list, left, lo, node, count, limit);
+	errors += check_tree(a, list, right, node, hi, count, limit);
+	return errors;
+}
+
+//Checks the list roots and tails against the bitmap index and, from
+//MM_CHECK_MEDIUM on, walks every list. Counts the listed blocks in
+//free_count and returns the number of errors.
+static int check_lists(struct arena *a, int level, unsigned long *free_count)
+{
+	unsigned long limit = (a->heap_epilogue - a->heap_prologue) / MIN_BLOCK;
+	unsigned long count;
+	unsigned long tree_count;
+	size_t dirty = 0;
+	int errors = 0;
+	int list;
+	int bit;
+	char *ptr;
+	char *prev;
+
+	*free_count = 0;
+	for(list = 0; list < MAX_LISTS; list++)
+		{
+			bit = (a->sl_bitmap[list >> SL_SHIFT] >> (list & (SL_COUNT - 1))) & 1;
+			if(bit != (GET_ROOT(a, list) != NULL)){
+				errors += check_fail(a, GET_ROOT(a, list), "list bitmap disagrees with root");
+      }
+			if(a->sl_bitmap[list >> SL_SHIFT] != 0 && !(a->fl_bitmap & (1U << (list >> SL_SHIFT)))){
+				errors += check_fail(a, NULL, "first level bitmap misses a non-empty range");
+      }
+			if((GET_ROOT(a, list) == NULL) != (GET_TAIL(a, list) == NULL)){
+				errors += check_fail(a, GET_ROOT(a, list), "list has a root or a tail but not both");
+      }
+			if(list >= sorted_from && (GET_ROOT(a, list) == NULL) != (a->tree[list] == 0)){
+				errors += check_fail(a, GET_ROOT(a, list), "sorted list and its tree disagree on emptiness");
+      }
+			if(GET_ROOT(a, list) == NULL){
+				continue;
+      }
+			if(PREV_FLIST_ADDRESS(a, GET_ROOT(a, list)) != NULL){
+				errors += check_fail(a, GET_ROOT(a, list), "list root has a previous link");
+      }
+			if(NEXT_FLIST_ADDRESS(a, GET_TAIL(a, list)) != NULL){
+				errors += check_fail(a, GET_TAIL(a, list), "list tail has a next link");
+      }
+			if(level < MM_CHECK_MEDIUM){
+				continue;
+      }
+			prev = NULL;
+			count = 0;
+			for(ptr = GET_ROOT(a, list); ptr != NULL; ptr = NEXT_FLIST_ADDRESS(a, ptr))
+				{
+					if(ptr <= a->heap_prologue || ptr >= a->heap_epilogue || ((uintptr_t)ptr & (ALIGNMENT - 1)))
+						{
+							errors += check_fail(a, ptr, "listed block outside the heap");
+							break;
+						}
+					if(++count > limit)
+						{
+							errors += check_fail(a, ptr, "list has a cycle");
+							break;
+						}
+					if(GET_ALLOC(HDRP(ptr))){
+						errors += check_fail(a, ptr, "listed block is allocated");
+          }
+					if(GET(HDRP(ptr)) != GET(FTRP(ptr))){
+						errors += check_fail(a, ptr, "listed block header and footer differ");
+          }
+					if(get_list(GET_SIZE(HDRP(ptr))) != list){
+						errors += check_fail(a, ptr, "listed block is in the wrong size class");
+          }
+					if(PREV_FLIST_ADDRESS(a, ptr) != prev){
+						errors += check_fail(a, ptr, "previous link does not match the walk");
+          }
+					if(list >= sorted_from)
+						{
+							if(prev != NULL && !tree_less(prev, ptr)){
+								errors += check_fail(a, ptr, "sorted list is out of size order");
+              }
+						}
+					else if(insert_policy == MM_INSERT_ADDRESS && prev != NULL && ptr < prev){
+						errors += check_fail(a, ptr, "list is out of address order");
+          }
+					if(list >= purge_from && GET(PURGE_MARK(ptr)) == 0){
+						dirty += GET_SIZE(HDRP(ptr));
+          }
+					prev = ptr;
+				}
+			if(ptr == NULL && prev != GET_TAIL(a, list)){
+				errors += check_fail(a, prev, "list tail is not the last block");
+      }
+			if(list >= sorted_from)
+				{
+					tree_count = 0;
+					errors += check_tree(a, list, GET_LINK(a, TREE_ROOT(a, list)), NULL, NULL, &tree_count, limit);
+					if(tree_count != count){
+						errors += check_fail(a, GET_ROOT(a, list), "sorted list and its tree hold different counts");
+          }
+				}
+			*free_count += count;
+		}
+	if(level >= MM_CHECK_MEDIUM && dirty != a->dirty_bytes){
+		errors += check_fail(a, NULL, "dirty byte count differs from the lists");
+  }
+	return errors;
+}
+
+//Checks the blocks of one range of a walk: footers, prev-alloc bits and
+//that no two free blocks touch. Counts the free blocks in r->blocks and
+//returns the number of errors.
+static int walk_check(struct heap_walk *w, struct walk_range *r)
+{
+	size_t prev_alloc = r->prev_free ? 0 : 2;
+	size_t prev_free = r->prev_free;
+	int errors = 0;
+	char *ptr;
+
+	for(ptr = r->start; ptr != r->end; ptr = NEXT_BLOCK(ptr))
+		{
+			if(GET_PREV_ALLOC(HDRP(ptr)) != prev_alloc){
+				errors += check_fail(w->a, ptr, "prev-alloc bit does not match the previous block");
+      }
+			if(GET_MMAPPED(HDRP(ptr))){
+				errors += check_fail(w->a, ptr, "heap block carries the mapped bit");
+      }
+			if(!GET_ALLOC(HDRP(ptr)))
+				{
+					if(GET(HDRP(ptr)) != GET(FTRP(ptr))){
+						errors += check_fail(w->a, ptr, "free block header and footer differ");
+          }
+					if(prev_free){
+						errors += check_fail(w->a, ptr, "free block follows a free block");
+          }
+					r->blocks++;
+				}
+			prev_free = !GET_ALLOC(HDRP(ptr));
+			prev_alloc = prev_free ? 0 : 2;
+		}
+	return errors;
+}
+
+//Counts the allocated blocks of one range of a walk and their bytes.
+static int walk_used(struct heap_walk *w, struct walk_range *r)
+{
+	char *ptr;
+
+	(void)w;
+	for(ptr = r->start; ptr != r->end; ptr = NEXT_BLOCK(ptr))
+		{
+			if(GET_ALLOC(HDRP(ptr)))
+				{
+					r->blocks++;
+					r->bytes += GET_SIZE(HDRP(ptr));
+				}
+		}
+	return 0;
+}
+
+//Walks every block from the prologue to the epilogue, checking sizes,
+//footers, prev-alloc bits and that no two free blocks touch, in parallel
+//on a large heap. Counts the free blocks in free_count and returns the
+//number of errors.
+static int check_blocks(struct arena *a, unsigned long *free_count)
+{
+	struct heap_walk w;
+	int errors = 0;
+	char *ptr;
+	int i;
+
+	*free_count = 0;
+	w.a = a;
+	w.top = a->heap_brk;
+	w.fn = walk_check;
+	if((ptr = heap_walk(&w)) == NULL){
+		return check_fail(a, w.bad, "block size is invalid");
+  }
+	for(i = 0; i < w.count; i++)
+		{
+			errors += w.range[i].errors;
+			*free_count += w.range[i].blocks;
+		}
+	if(HDRP(ptr) != a->heap_epilogue){
+		errors += check_fail(a, ptr, "block chain ends before the epilogue");
+  }
+	else if(GET_PREV_ALLOC(a->heap_epilogue) != (w.range[w.count - 1].last_free ? 0 : 2)){
+		errors += check_fail(a, a->heap_epilogue, "epilogue prev-alloc bit is stale");
+  }
+	return errors;
+}
+
+//Checks one arena at an MM_CHECK_* level and returns the number of errors.
+//Caller holds the arena lock.
+static int arena_check(struct arena *a, int level)
+{
+	unsigned long listed;
+	unsigned long walked;
+	int errors = 0;
+	int bin;
+	char *ptr;
+
+	if(GET(HDRP(a->heap_prologue)) != PACK(DWORD, 2, 1)){
+		errors += check_fail(a, a->heap_prologue, "prologue header is damaged");
+  }
+	if(GET_SIZE(a->heap_epilogue) != 0 || !GET_ALLOC(a->heap_epilogue) ||
+	   a->heap_epilogue + WSIZE != a->heap_brk){
+		errors += check_fail(a, a->heap_epilogue, "epilogue is damaged or not at the break");
+  }
+	errors += check_lists(a, level, &listed);
+	if(level < MM_CHECK_FULL || errors > 0){
+		return errors;
+  }
+	errors += check_blocks(a, &walked);
+	if(errors == 0 && walked != listed){
+		errors += check_fail(a, NULL, "free block count differs from the lists");
+  }
+	for(bin = 0; bin < QUICK_BINS; bin++)
+		{
+			for(ptr = a->quick[bin]; ptr != NULL && errors == 0; ptr = GET_PTR(ptr))
+				{
+					if(!GET_ALLOC(HDRP(ptr)) || GET_SIZE(HDRP(ptr)) / DWORD != (size_t)bin){
+						errors += check_fail(a, ptr, "deferred block is free or in the wrong bin");
+          }
+				}
+		}
+	return errors;
+}
+
+//Runs the sampled check every check_every heap operations, aborting on the
+//first damaged heap before the damage spreads. Caller holds the arena lock.
+static void arena_sample(struct arena *a)
+{
+	if(check_every <= 0 || ++a->ops % check_every != 0){
+		return;
+  }
+	if(arena_check(a, check_level) > 0){
+		abort();
+  }
+}
+
+/*
+ * mm_init - Initializes the heap with the default options.
+ */
+int mm_init(void)
+{
+	return mm_init_opts(NULL);
+}
+
+/*
+ * mm_init_opts - Allocates memory to the heap and begins list of free lists.
+ * A NULL opts, or a zeroed field, selects the default for that option.
+ */
+int mm_init_opts(const struct mm_options *opts)
+{
+	int ret;
+
+	pthread_mutex_lock(&arena_lock);
+	ret = heap_init(opts);
+	pthread_mutex_unlock(&arena_lock);
+	return ret;
+}
+
+//Resets every arena. Caller holds arena_lock.
+static int heap_init(const struct mm_options *opts)
+{
+	int i;
+
+	insert_policy = (opts != NULL) ? opts->insert_policy : MM_INSERT_ADDRESS;
+	if(insert_policy < MM_INSERT_ADDRESS || insert_policy > MM_INSERT_FIFO){
+		return -1;
+  }
+	fit_scan = (opts != NULL) ? opts->fit_scan : 0;
+	if(fit_scan <= 0)
+		{
+			fit_scan = (insert_policy == MM_INSERT_ADDRESS) ? 1 : DEFAULT_FIT_SCAN;
+		}
+	sorted_from = get_list(SORTED_MIN);
+	if(opts != NULL && opts->sorted_min != 0)
+		{
+			sorted_from = (opts->sorted_min < 0) ? MAX_LISTS : get_list((size_t)opts->sorted_min);
+		}
+	//Every block in a sorted class must hold the treap links.
+	sorted_from = MAX(sorted_from, get_list(TREE_BLOCK) + 1);
+	//A split_shift of s keeps leftovers under 1/2^s of the class minimum
+	//with the allocation.
+	for(i = 0; i < MAX_LISTS; i++)
+		{
+			split_min[i] = SPLIT_THRESHOLD;
+			if(opts != NULL && opts->split_shift > 0 && opts->split_shift < 32){
+				split_min[i] = MAX(SPLIT_THRESHOLD, list_min(i) >> opts->split_shift);
+      }
+		}
+	//Purge marks are kept only in sorted classes, where blocks never change
+	//size while listed.
+	purge_from = MAX(get_list(PURGE_MIN), sorted_from);
+	purge_limit = PURGE_LIMIT;
+	if(opts != NULL && opts->purge_limit != 0)
+		{
+			purge_limit = (opts->purge_limit < 0) ? SIZE_MAX : (size_t)opts->purge_limit;
+		}
+	huge_pages = (opts != NULL) ? opts->huge_pages : MM_HUGE_NONE;
+	if(huge_pages < MM_HUGE_NONE || huge_pages > MM_HUGE_TLB){
+		return -1;
+  }
+	high_min = SIZE_MAX;
+	if(opts != NULL && opts->high_min > 0){
+		high_min = adjust_size((size_t)opts->high_min);
+  }
+	tcache_limit = (opts != NULL) ? opts->tcache_count : 0;
+	if(tcache_limit == 0)
+		{
+			tcache_limit = TCACHE_COUNT;
+		}
+	defer_limit = (opts != NULL) ? opts->defer_limit : 0;
+	walk_threads = (opts != NULL) ? opts->walk_threads : 0;
+	remote_queue = (opts == NULL || opts->remote_queue >= 0);
+	check_every = (opts != NULL && opts->check_every != 0) ? opts->check_every : CHECK_EVERY;
+	check_level = (opts != NULL && opts->check_level != 0) ? opts->check_level : MM_CHECK_FULL;
+	arena_count = (opts != NULL) ? opts->arenas : 0;
+	if(arena_count <= 0)
+		{
+			arena_count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+		}
+	arena_count = MAX(1, MIN(arena_count, MAX_ARENAS));
+	//NUMA is on by default on machines with more than one node. Each node
+	//needs a mapped arena of its own.
+	numa_nodes = MIN(numa_count(), MAX_ARENAS - 1);
+	numa_on = (opts != NULL && opts->numa != 0) ? (opts->numa > 0) : (numa_nodes > 1);
+	if(numa_on){
+		arena_count = MIN(MAX(arena_count, 1 + numa_nodes), MAX_ARENAS);
+  }
+	memset(next_node_arena, 0, sizeof(next_node_arena));
+	slab_max = (opts != NULL) ? opts->slab_max : 0;
+	if(slab_max == 0)
+		{
+			slab_max = SLAB_MAX;
+		}
+	slab_max = (slab_max < 0) ? 0 : MIN(slab_max, SLAB_MAX);
+	mmap_threshold = MMAP_THRESHOLD;
+	if(opts != NULL && opts->mmap_threshold != 0)
+		{
+			mmap_threshold = (opts->mmap_threshold < 0) ? SIZE_MAX : (size_t)opts->mmap_threshold;
+		}
+#ifdef MM_COMPACT
+	//Heap block sizes must fit a 4-byte header.
+	mmap_threshold = MIN(mmap_threshold, (size_t)1 << 30);
+#endif
+	page_size = sysconf(_SC_PAGESIZE);
+	grow_max = GROW_MAX;
+	if(opts != NULL && opts->grow_max != 0)
+		{
+			grow_max = MAX((size_t)opts->grow_max, CHUNKSIZE);
+		}
+	trim_threshold = TRIM_THRESHOLD;
+	if(opts != NULL && opts->trim_threshold != 0)
+		{
+			trim_threshold = (opts->trim_threshold < 0) ? SIZE_MAX : (size_t)opts->trim_threshold;
+		}
+	next_arena = 0;
+	//Drop every thread's cached blocks, they belong to the old heap.
+	heap_generation++;
+	slab_init();
+	mmap_init();
+
+	//Mapped arenas are kept and emptied, so their mappings are reused,
+	//rebound to the node their index now maps to.
+	for(i = 1; i < MAX_ARENAS; i++)
+		{
+			if(arenas[i] != NULL){
+				arena_bind(arenas[i], arena_node(i));
+      }
+		}
+	for(i = 0; i < MAX_ARENAS; i++)
+		{
+			if(arenas[i] != NULL && arena_init(arenas[i]) < 0){
+				return -1;
+      }
+		}
+	return 0;
+}
+
+//Picks the size of the next heap extension. Misses that come within
+//GROW_WINDOW mallocs of each other double it up to grow_max; a long quiet
+//spell halves it back towards CHUNKSIZE.
+static size_t arena_grow(struct arena *a)
+{
+	unsigned long gap = a->mallocs - a->last_miss;
+
+	a->last_miss = a->mallocs;
+	if(gap < GROW_WINDOW)
+		{
+			a->grow = MIN(2 * a->grow, grow_max);
+		}
+	else if(gap > 16 * GROW_WINDOW)
+		{
+			a->grow = MAX(a->grow / 2, CHUNKSIZE);
+		}
+	return MAX(a->grow, CHUNKSIZE);
+}
+
+//Gives the pages of a large trailing free block back to the OS while
+//keeping one growth step resident. The block keeps its address range, so
+//the heap layout is unchanged and the pages come back zeroed on next use.
+//Trims again only once the block has doubled since the last one.
+static void arena_trim(struct arena *a, char *ptr)
+{
+	size_t size = GET_SIZE(HDRP(ptr));
+
+	if(size < trim_threshold || size < 2 * a->trim_size){
+		return;
+  }
+	a->trim_size = size;
+	arena_release(a, (char *)ptr + DWORD + a->grow, FTRP(ptr));
+}
+
+//Rounds a request plus its header up to a block size, at least MIN_BLOCK.
+static size_t adjust_size(size_t size)
+{
+  if(size <= MIN_BLOCK - WSIZE)
+		{
+			return MIN_BLOCK;
+		}
+	return DWORD * ((size + (WSIZE) + (DWORD-1)) / DWORD);
+}
+
+//Allocates a block of at least size bytes from the heap. Caller holds
+//the arena lock.
+static void * heap_malloc(struct arena *a, size_t size)
+{
+	size_t extend_size;
+	char *ptr;
+
+	arena_sample(a);
+	remote_drain(a);
+	a->mallocs++;
+	//A deferred block of the exact size skips the search and the split.
+	if(size / DWORD < QUICK_BINS && (ptr = a->quick[size / DWORD]) != NULL)
+		{
+			a->quick[size / DWORD] = GET_PTR(ptr);
+			a->quick_count--;
+			a->defer_hits++;
+			return ptr;
+		}
+	//Use find_fit helper function to find a free block
+	if((ptr = find_fit(a, size)) != NULL )
+		{
+			return place_fit(a, ptr, size);
+		}
+	//Coalesce the deferred blocks before growing the heap.
+	if(a->quick_count > 0)
+		{
+			quick_flush(a);
+			if((ptr = find_fit(a, size)) != NULL )
+				{
+					return place_fit(a, ptr, size);
+				}
+		}
+	//If nothing is found, we will need to extend a current block.
+	extend_size = MAX(size, arena_grow(a));
+	if((ptr = extend_heap(a, extend_size/WSIZE)) == NULL ){
+		return NULL;
+  }
+	place(a, ptr, size);
+	return ptr;
+}
+
+//Frees a block back to the heap, works via immediate coalescing. Caller
+//holds the arena lock.
+static void heap_free(struct arena *a, void *ptr)
+{
+  size_t prev_block_alloc;
+  size_t next_block_size;
+  size_t next_block_alloc;
+	size_t ptr_size;
+	char *next_block;
+
+	arena_sample(a);
+	ptr_size = GET_SIZE(HDRP(ptr));
+	next_block = NEXT_BLOCK(ptr);
+
+	prev_block_alloc = GET_PREV_ALLOC(HDRP(ptr));
+	next_block_size = GET_SIZE(HDRP(next_block));
+	next_block_alloc = GET_ALLOC(HDRP(next_block));
+
+	PUT(HDRP(ptr), PACK(ptr_size, prev_block_alloc, 0));
+	PUT(FTRP(ptr), PACK(ptr_size, prev_block_alloc, 0));
+	PUT(HDRP(next_block), PACK(next_block_size, 0, next_block_alloc));
+
+	if(!next_block_alloc){
+		PUT(FTRP(next_block), PACK(next_block_size, 0, 0));
+  }
+	ptr = coalesce(a, ptr); //After freeing, coalesce.
+	if(HDRP(NEXT_BLOCK(ptr)) == a->heap_epilogue){
+		arena_trim(a, ptr);
+  }
+	if(a->dirty_bytes > purge_limit && !a->pool){
+		arena_purge(a);
+  }
+}
+
+//Trims an allocated block down to size, freeing the tail when it is big
+//enough to be worth a block of its own. Caller holds the arena lock.
+static void realloc_split(struct arena *a, void *ptr, size_t size)
+{
+	size_t old_size = GET_SIZE(HDRP(ptr));
+	char *split_ptr;
+
+	if(old_size - size <= split_min[get_list(size)]){
+		return;
+  }
+	PUT(HDRP(ptr), PACK(size, GET_PREV_ALLOC(HDRP(ptr)), 1));
+	split_ptr = NEXT_BLOCK(ptr);
+	PUT(HDRP(split_ptr), PACK((old_size - size), 2, 1));
+	heap_free(a, split_ptr);
+}
+
+//Queues a block freed by a thread that does not own its arena. The push
+//is a single atomic exchange, so the free is wait-free; the link to the
+//rest of the queue is written just after it.
+static void remote_push(struct arena *a, char *ptr)
+{
+	char *next;
+
+	PUT_PTR(ptr, REMOTE_PENDING);
+	next = __atomic_exchange_n(&a->remote, ptr, __ATOMIC_ACQ_REL);
+	__atomic_store_n((char **)ptr, next, __ATOMIC_RELEASE);
+}
+
+//Takes the whole queue of cross-thread frees and frees each block to the
+//arena. A block whose pusher has not yet written its link is waited for.
+//Caller holds the arena lock.
+static void remote_drain(struct arena *a)
+{
+	char *ptr;
+	char *next;
+
+	if(__atomic_load_n(&a->remote, __ATOMIC_RELAXED) == NULL){
+		return;
+  }
+	ptr = __atomic_exchange_n(&a->remote, NULL, __ATOMIC_ACQUIRE);
+	a->remote_drains++;
+	while(ptr != NULL)
+		{
+			while((next = __atomic_load_n((char **)ptr, __ATOMIC_ACQUIRE)) == REMOTE_PENDING){
+				sched_yield();
+      }
+			arena_free(a, ptr);
+			a->remote_drained++;
+			ptr = next;
+		}
+}
+
+//Frees a block to the arena, deferring the coalesce for small blocks when
+//deferred coalescing is on. Caller holds the arena lock.
+static void arena_free(struct arena *a, void *ptr)
+{
+	size_t bin = GET_SIZE(HDRP(ptr)) / DWORD;
+
+	if(defer_limit <= 0 || bin >= QUICK_BINS)
+		{
+			heap_free(a, ptr);
+			return;
+		}
+	PUT_PTR(ptr, a->quick[bin]);
+	a->quick[bin] = ptr;
+	a->defer_frees++;
+	if(++a->quick_count > defer_limit){
+		quick_flush(a);
+  }
+}
+
+//Coalesces every deferred block in one batch. Caller holds the arena lock.
+static void quick_flush(struct arena *a)
+{
+	char *ptr;
+	int bin;
+
+	a->defer_flushes++;
+	a->defer_flushed += a->quick_count;
+	for(bin = 0; bin < QUICK_BINS; bin++)
+		{
+			while((ptr = a->quick[bin]) != NULL)
+				{
+					a->quick[bin] = GET_PTR(ptr);
+					heap_free(a, ptr);
+				}
+		}
+	a->quick_count = 0;
+}
+
+//Cuts up to n blocks of size from the front of free block ptr in one pass,
+//freeing what is left when it is big enough to be a block of its own.
+//Every block cut off before another counts as a split, as if placed one
+//at a time. Returns the number of blocks stored in out. Caller holds the
+//arena lock.
+static size_t heap_carve(struct arena *a, char *ptr, size_t size, size_t n, void **out)
+{
+	size_t old_size = GET_SIZE(HDRP(ptr));
+	size_t prev_alloc = GET_PREV_ALLOC(HDRP(ptr));
+	size_t frag_count;
+	size_t next_block_size;
+	size_t count;
+	size_t i;
+	char *next_block = NEXT_BLOCK(ptr);
+
+	arena_sample(a);
+	next_block_size = GET_SIZE(HDRP(next_block));
+	count = MIN(n, old_size / size);
+	STAT_ADD(splits[get_list(size)], count - 1);
+	frag_count = old_size - count * size;
+	if(HDRP(next_block) == a->heap_epilogue){
+		a->trim_size = 0;
+  }
+	remove_block(a, ptr);
+	for(i = 0; i < count; i++)
+		{
+			out[i] = ptr;
+			PUT(HDRP(ptr), PACK(size, prev_alloc, 1));
+			prev_alloc = 2;
+			ptr = NEXT_BLOCK(ptr);
+		}
+	if(frag_count > split_min[get_list(size)])
+		{
+			STAT_ADD(splits[get_list(size)], 1);
+			PUT(HDRP(ptr), PACK(frag_count, 2, 0));
+			PUT(FTRP(ptr), PACK(frag_count, 2, 0));
+			add_block(a, ptr);
+		}
+	//The last block absorbs a tail too small to split off.
+	else
+		{
+			ptr = out[count - 1];
+			PUT(HDRP(ptr), PACK(size + frag_count, GET_PREV_ALLOC(HDRP(ptr)), 1));
+			PUT(HDRP(next_block), PACK(next_block_size, 2, GET_ALLOC(HDRP(next_block))));
+		}
+	heap_touch(a, out[count - 1]);
+	return count;
+}
+
+//Allocates n blocks of size, carving each free block found for as many as
+//it holds. Returns the number allocated. Caller holds the arena lock.
+static size_t heap_malloc_batch(struct arena *a, size_t size, size_t n, void **out)
+{
+	size_t done = 0;
+	size_t want;
+	char *ptr;
+
+	while(done < n && size / DWORD < QUICK_BINS && (ptr = a->quick[size / DWORD]) != NULL)
+		{
+			a->quick[size / DWORD] = GET_PTR(ptr);
+			a->quick_count--;
+			a->defer_hits++;
+			out[done++] = ptr;
+		}
+	while(done < n)
+		{
+			a->mallocs++;
+			//Ask for the whole remainder at once, bounded by one growth step.
+			want = MIN(n - done, MAX(grow_max / size, 1));
+			if((ptr = find_fit(a, want * size)) == NULL &&
+			   (ptr = find_fit(a, size)) == NULL)
+				{
+					if(a->quick_count > 0){
+						quick_flush(a);
+          }
+					if((ptr = find_fit(a, want * size)) == NULL &&
+					   (ptr = extend_heap(a, MAX(want * size, arena_grow(a)) / WSIZE)) == NULL){
+						break;
+          }
+				}
+			done += heap_carve(a, ptr, size, want, out + done);
+		}
+	return done;
+}
+
+//Allocates a block whose payload is a multiple of align. The free block
+//found is asked for enough slack to hold an aligned payload after a gap of
+//at least MIN_BLOCK, which is split off and stays free. Caller holds the
+//arena lock.
+static void * heap_memalign(struct arena *a, size_t align, size_t size)
+{
+	size_t need = size + align + MIN_BLOCK;
+	size_t old_size;
+	size_t gap;
+	char *ptr;
+	char *aligned;
+
+	a->mallocs++;
+	if((ptr = find_fit(a, need)) == NULL)
+		{
+			if(a->quick_count > 0){
+				quick_flush(a);
+      }
+			if((ptr = find_fit(a, need)) == NULL &&
+			   (ptr = extend_heap(a, MAX(need, arena_grow(a)) / WSIZE)) == NULL){
+				return NULL;
+      }
+		}
+	aligned = (char *)(((uintptr_t)ptr + align - 1) & ~(uintptr_t)(align - 1));
+	if(aligned != ptr && (size_t)(aligned - ptr) < MIN_BLOCK){
+		aligned = (char *)(((uintptr_t)ptr + MIN_BLOCK + align - 1) & ~(uintptr_t)(align - 1));
+  }
+	//Give the leading gap back as a free block of its own.
+	if(aligned != ptr)
+		{
+			old_size = GET_SIZE(HDRP(ptr));
+			gap = aligned - ptr;
+			remove_block(a, ptr);
+			PUT(HDRP(ptr), PACK(gap, GET_PREV_ALLOC(HDRP(ptr)), 0));
+			PUT(FTRP(ptr), PACK(gap, GET_PREV_ALLOC(HDRP(ptr)), 0));
+			add_block(a, ptr);
+			PUT(HDRP(aligned), PACK(old_size - gap, 0, 0));
+			PUT(FTRP(aligned), PACK(old_size - gap, 0, 0));
+			add_block(a, aligned);
+		}
+	return place(a, aligned, size);
+}
+
+//Orders block pointers by address for mm_free_batch.
+static int ptr_compare(const void *x, const void *y)
+{
+	uintptr_t p = (uintptr_t)*(void * const *)x;
+	uintptr_t q = (uintptr_t)*(void * const *)y;
+
+	return (p > q) - (p < q);
+}
+
+//Records that the heap has been written up to the block after allocated
+//block ptr, including that block's header and every word a free block
+//keeps: list and treap links and the purge mark.
+static void heap_touch(struct arena *a, char *ptr)
+{
+	char *end = PURGE_MARK(NEXT_BLOCK(ptr)) + WSIZE;
+
+	if(end > a->zero_lo){
+		a->zero_lo = end;
+  }
+}
+
+//Allocates a block for calloc and sets dirty to how many of its first len
+//bytes may be non-zero. Only mapped arenas know their fresh pages are zero.
+//Caller holds the arena lock.
+static void * heap_calloc(struct arena *a, size_t size, size_t len, size_t *dirty)
+{
+	char *zero_lo = a->zero_lo;
+	char *ptr;
+
+	if((ptr = heap_malloc(a, size)) == NULL){
+		return NULL;
+  }
+	//Fresh pages are zero apart from the trailing block's old footer, which
+	//can only land in the last word.
+	if(a->heap_limit == NULL || len <= WSIZE)
+		{
+			*dirty = len;
+		}
+	else if(ptr >= zero_lo)
+		{
+			*dirty = 0;
+			memset(ptr + len - WSIZE, 0, WSIZE);
+		}
+	else
+		{
+			*dirty = MIN((size_t)(zero_lo - ptr), len);
+			memset(ptr + len - WSIZE, 0, WSIZE);
+		}
+	return ptr;
+}
+
+//Resizes a block without leaving its place in the heap, or returns NULL
+//when the block has to move. Caller holds the arena lock.
+static void * heap_realloc(struct arena *a, void *ptr, size_t size)
+{
 	size_t old_size = GET_SIZE(HDRP(ptr));
 	size_t old_prev_alloc = GET_PREV_ALLOC(HDRP(ptr));
-  if(size <= 32) //32 bytes is our minimum block size. This verifies at least minimum
+	size_t next_size;
+	size_t prev_size;
+	size_t total;
+	char *next_ptr;
+	char *prev_ptr;
+
+	size = adjust_size(size);
+  //Case 1: Smaller or same size. Block will be split.
+	if(size <= old_size)
+		{
+			realloc_split(a, ptr, size);
+			return ptr;
+		}
+	next_ptr = NEXT_BLOCK(ptr);
+	next_size = GET_ALLOC(HDRP(next_ptr)) ? 0 : GET_SIZE(HDRP(next_ptr));
+  //Case 2: Last block in the heap, possibly before a free one. Extend the
+  //heap so the next block is free and big enough.
+	if(old_size + next_size < size &&
+	   (HDRP(next_ptr) == a->heap_epilogue ||
+	    (next_size != 0 && HDRP(NEXT_BLOCK(next_ptr)) == a->heap_epilogue)))
+		{
+			if(extend_heap(a, MAX(size - old_size - next_size, arena_grow(a)) / WSIZE) != NULL){
+				next_size = GET_SIZE(HDRP(next_ptr));
+      }
+		}
+  //Case 3: Grow into the free next block and split off the surplus.
+	if(next_size != 0 && old_size + next_size >= size)
+		{
+			remove_block(a, next_ptr);
+			PUT(HDRP(ptr), PACK((next_size + old_size), old_prev_alloc, 1));
+			CHANGE_PREV(HDRP(NEXT_BLOCK(ptr)), 2);
+			realloc_split(a, ptr, size);
+			heap_touch(a, ptr);
+			return ptr;
+		}
+  //Case 4: Slide down into the free previous block, taking the next block
+  //too when it is free.
+	if(!old_prev_alloc)
+		{
+			prev_ptr = PREV_BLOCK(ptr);
+			prev_size = GET_SIZE(HDRP(prev_ptr));
+			total = prev_size + old_size + next_size;
+			if(total >= size)
+				{
+					remove_block(a, prev_ptr);
+					if(next_size != 0){
+						remove_block(a, next_ptr);
+          }
+					PUT(HDRP(prev_ptr), PACK(total, 2, 1));
+					CHANGE_PREV(HDRP(NEXT_BLOCK(prev_ptr)), 2);
+					memmove(prev_ptr, ptr, old_size - WSIZE);
+					realloc_split(a, prev_ptr, size);
+					heap_touch(a, prev_ptr);
+					return prev_ptr;
+				}
+		}
+	return NULL;
+}
+
+//Destructor for a thread's cache, returns its blocks to the heap.
+static void tcache_release(void *arg)
+{
+	struct tcache *tc = arg;
+	int bin;
+
+	if(tc->generation == heap_generation)
+		{
+			for(bin = 0; bin < TCACHE_BINS; bin++)
+				{
+					tcache_flush(tc, bin, 0);
+				}
+			//No thread may allocate from the arena again to drain it.
+			pthread_mutex_lock(&tc->arena->lock);
+			remote_drain(tc->arena);
+			pthread_mutex_unlock(&tc->arena->lock);
+		}
+#ifdef MM_STATS
+	//Fold the counters into the retired totals before the thread is gone.
+	pthread_mutex_lock(&stats_lock);
+	stats_add(&stats_retired, &tc->stats);
+	if(tc->prev != NULL){
+		tc->prev->next = tc->next;
+  }
+	else{
+		stats_threads = tc->next;
+  }
+	if(tc->next != NULL){
+		tc->next->prev = tc->prev;
+  }
+	pthread_mutex_unlock(&stats_lock);
+#endif
+}
+
+static void tcache_key_init(void)
+{
+	pthread_key_create(&tcache_key, tcache_release);
+}
+
+//Gets the calling thread's cache and arena, emptying the cache if the heap
+//was reset since it was last used.
+static struct tcache * tcache_get(void)
+{
+	struct tcache *tc = &tcache;
+
+	if(tc->generation != heap_generation)
+		{
+			memset(tc->bin, 0, sizeof(tc->bin));
+			memset(tc->count, 0, sizeof(tc->count));
+			tc->generation = heap_generation;
+			tc->arena = arena_assign();
+			if(!tc->registered)
+				{
+					pthread_once(&tcache_once, tcache_key_init);
+					pthread_setspecific(tcache_key, tc);
+					tc->registered = 1;
+#ifdef MM_STATS
+					pthread_mutex_lock(&stats_lock);
+					tc->next = stats_threads;
+					if(stats_threads != NULL){
+						stats_threads->prev = tc;
+          }
+					stats_threads = tc;
+					pthread_mutex_unlock(&stats_lock);
+#endif
+				}
+		}
+	return tc;
+}
+
+//Returns cached blocks to their arenas until keep remain. Blocks freed by
+//this thread may belong to other arenas, so locks are switched as needed.
+static void tcache_flush(struct tcache *tc, int bin, int keep)
+{
+	struct arena *locked = NULL;
+	struct arena *a;
+	char *ptr;
+
+	while(tc->count[bin] > keep)
+		{
+			ptr = tc->bin[bin];
+			tc->bin[bin] = GET_PTR(ptr);
+			tc->count[bin]--;
+			a = arena_of(ptr);
+			if(remote_queue && a != tc->arena)
+				{
+					remote_push(a, ptr);
+					continue;
+				}
+			if(a != locked)
+				{
+					if(locked != NULL){
+						pthread_mutex_unlock(&locked->lock);
+          }
+					pthread_mutex_lock(&a->lock);
+					locked = a;
+				}
+			arena_free(a, ptr);
+		}
+	if(locked != NULL){
+		pthread_mutex_unlock(&locked->lock);
+  }
+}
+
+//Allocates one block for the caller plus up to TCACHE_BATCH - 1 more for
+//the bin. Caller holds the arena lock.
+static void * tcache_refill(struct tcache *tc, struct arena *a, size_t size)
+{
+	int bin = size / DWORD;
+	char *ptr;
+	char *extra;
+
+	if((ptr = heap_malloc(a, size)) == NULL){
+		return NULL;
+  }
+	while(tc->count[bin] < MIN(TCACHE_BATCH, tcache_limit) - 1)
+		{
+			if((extra = heap_malloc(a, size)) == NULL){
+				break;
+      }
+			PUT_PTR(extra, tc->bin[bin]);
+			tc->bin[bin] = extra;
+			tc->count[bin]++;
+		}
+	return ptr;
+}
+
+//Allocates from the thread's arena, then from the main arena, whose heap
+//is not bounded by ARENA_SIZE.
+static void * arena_malloc(struct tcache *tc, size_t size, int refill)
+{
+	struct arena *a = tc->arena;
+	char *ptr;
+
+	pthread_mutex_lock(&a->lock);
+	ptr = refill ? tcache_refill(tc, a, size) : heap_malloc(a, size);
+	pthread_mutex_unlock(&a->lock);
+	if(ptr == NULL && a != &main_arena)
+		{
+			pthread_mutex_lock(&main_arena.lock);
+			ptr = heap_malloc(&main_arena, size);
+			pthread_mutex_unlock(&main_arena.lock);
+		}
+	return ptr;
+}
+
+/*
+ * mm_malloc - Allocates a block of at least size bytes.
+ */
+void *mm_malloc(size_t size)
+{
+	void *ptr = malloc_any(size);
+
+	TRACE('m', ptr, NULL, size);
+	return ptr;
+}
+
+//Serves the block from the thread cache if it can, otherwise from the
+//thread's arena. Tiny and huge requests go to slabs and mappings.
+static void * malloc_any(size_t size)
+{
+	struct tcache *tc;
+	char *ptr;
+	int bin;
+
+	if(size == 0){ //No point in allocating an empty block!
+		return NULL;
+  }
+	STAT_ADD(allocs[get_list(adjust_size(size))], 1);
+	//Tiny requests go to the slabs, falling back to the heap when no run
+	//can be had.
+	if(size <= (size_t)slab_max && (ptr = slab_malloc(size)) != NULL){
+		return ptr;
+  }
+	if(size > mmap_threshold){
+		return mmap_malloc(size);
+  }
+	size = adjust_size(size);
+	bin = size / DWORD;
+	tc = tcache_get();
+	if(tcache_limit > 0 && bin < TCACHE_BINS)
+		{
+			if((ptr = tc->bin[bin]) != NULL)
+				{
+					tc->bin[bin] = GET_PTR(ptr);
+					tc->count[bin]--;
+					return ptr;
+				}
+			return arena_malloc(tc, size, 1);
+		}
+	return arena_malloc(tc, size, 0);
+}
+
+/*
+ * mm_malloc_onnode - Allocates a block of at least size bytes whose memory
+ * is on NUMA node node, or NULL for a node out of range. The block comes
+ * from the node's first arena, bypassing slabs and the thread cache; large
+ * requests get a mapping bound to the node. Without NUMA this is mm_malloc.
+ */
+void *mm_malloc_onnode(size_t size, int node)
+{
+	struct arena *a;
+	char *ptr;
+	int i;
+
+	if(!numa_on){
+		return mm_malloc(size);
+  }
+	if(size == 0 || node < 0 || node >= numa_nodes){
+		return NULL;
+  }
+	STAT_ADD(allocs[get_list(adjust_size(size))], 1);
+	if(size > mmap_threshold)
+		{
+			if((ptr = mmap_malloc(size)) != NULL){
+				numa_bind(MMAP_BASE(ptr), MMAP_LEN(MMAP_BASE(ptr)), node, MPOL_MF_MOVE);
+      }
+			TRACE('m', ptr, NULL, size);
+			return ptr;
+		}
+	pthread_mutex_lock(&arena_lock);
+	i = node_arena(node, 0);
+	if(arenas[i] == NULL){
+		arenas[i] = arena_create(node);
+  }
+	a = arenas[i];
+	pthread_mutex_unlock(&arena_lock);
+	if(a == NULL){
+		return NULL;
+  }
+	pthread_mutex_lock(&a->lock);
+	ptr = heap_malloc(a, adjust_size(size));
+	pthread_mutex_unlock(&a->lock);
+	TRACE('m', ptr, NULL, size);
+	return ptr;
+}
+
+/*
+ * mm_free - Frees a block from any of mm_malloc's sources.
+ */
+void mm_free(void *ptr)
+{
+	TRACE('f', ptr, NULL, 0);
+	free_any(ptr);
+}
+
+//Keeps small blocks in the thread cache, flushing half of a full bin at
+//once. Other blocks go straight back to the arena or mapping they came from.
+static void free_any(void *ptr)
+{
+	if(ptr == NULL){
+		return;
+  }
+#ifdef MM_STATS
+	tcache_get();
+	STAT_ADD(frees[get_list(payload_size(ptr) + WSIZE)], 1);
+#endif
+	if(is_slab(ptr))
+		{
+			slab_free(ptr);
+			return;
+		}
+	if(GET_MMAPPED(HDRP(ptr)))
+		{
+			mmap_free(ptr);
+			return;
+		}
+	free_block(ptr, GET_SIZE(HDRP(ptr)));
+}
+
+/*
+ * mm_free_sized - Frees a block the caller allocated with size bytes. The
+ * size picks the path, so the header is only read when the block goes
+ * back to its arena.
+ */
+void mm_free_sized(void *ptr, size_t size)
+{
+	if(ptr == NULL){
+		return;
+  }
+	TRACE('f', ptr, NULL, size);
+	STAT_ADD(frees[get_list(adjust_size(size))], 1);
+	//Only sizes above the threshold are mapped, memalign's too; the bit
+	//still decides, so a wrong size cannot send a heap block to munmap.
+	if(size > mmap_threshold && GET_MMAPPED(HDRP(ptr)))
+		{
+			mmap_free(ptr);
+			return;
+		}
+	//Slab sizes fall back to the heap when no run can be had.
+	if(size <= (size_t)slab_max && is_slab(ptr))
+		{
+			slab_free(ptr);
+			return;
+		}
+	free_block(ptr, adjust_size(size));
+}
+
+//Frees a heap block of at least size bytes to the thread cache, or to its
+//arena when the size is not cached.
+static void free_block(void *ptr, size_t size)
+{
+	struct tcache *tc;
+	struct arena *a;
+	int bin = size / DWORD;
+
+	//A block from another node's arena goes straight home, so no thread
+	//here reuses remote memory from its cache.
+	if(numa_on)
+		{
+			a = arena_of(ptr);
+			if(a->node >= 0 && a->node != tcache_get()->arena->node)
+				{
+					STAT_ADD(remote_frees, 1);
+					bin = TCACHE_BINS;
+				}
+		}
+	if(tcache_limit > 0 && bin < TCACHE_BINS)
+		{
+			tc = tcache_get();
+			if(tc->count[bin] >= tcache_limit){
+				tcache_flush(tc, bin, tcache_limit / 2);
+      }
+			PUT_PTR(ptr, tc->bin[bin]);
+			tc->bin[bin] = ptr;
+			tc->count[bin]++;
+			return;
+		}
+	a = arena_of(ptr);
+	if(remote_queue && a != tcache_get()->arena)
+		{
+			remote_push(a, ptr);
+			return;
+		}
+	pthread_mutex_lock(&a->lock);
+	arena_free(a, ptr);
+	pthread_mutex_unlock(&a->lock);
+}
+
+/*
+ * mm_memalign - Allocates size bytes at a multiple of align, a power of two.
+ * Alignments the heap gives anyway go through mm_malloc. Large requests
+ * get an aligned mapping of their own, as in mm_malloc, and the rest are
+ * cut from the heap.
+ */
+void *mm_memalign(size_t align, size_t size)
+{
+	struct tcache *tc;
+	struct arena *a;
+	char *ptr;
+
+	if(align == 0 || (align & (align - 1)) != 0){
+		return NULL;
+  }
+	if(align <= ALIGNMENT){
+		return mm_malloc(size);
+  }
+	if(size == 0 || size > SIZE_MAX / 2 - align){
+		return NULL;
+  }
+	if(size > mmap_threshold)
+		{
+			STAT_ADD(allocs[get_list(adjust_size(size))], 1);
+			ptr = mmap_memalign(align, size);
+			TRACE('m', ptr, NULL, size);
+			return ptr;
+		}
+	size = adjust_size(size);
+#ifdef MM_COMPACT
+	//The block cut from the heap, slack included, must fit a 4-byte header.
+	if(size + align + MIN_BLOCK > (size_t)1 << 30){
+		return NULL;
+  }
+#endif
+	tc = tcache_get();
+	STAT_ADD(allocs[get_list(size)], 1);
+	a = tc->arena;
+	pthread_mutex_lock(&a->lock);
+	ptr = heap_memalign(a, align, size);
+	pthread_mutex_unlock(&a->lock);
+	if(ptr == NULL && a != &main_arena)
+		{
+			pthread_mutex_lock(&main_arena.lock);
+			ptr = heap_memalign(&main_arena, align, size);
+			pthread_mutex_unlock(&main_arena.lock);
+		}
+	TRACE('m', ptr, NULL, size);
+	return ptr;
+}
+
+/*
+ * mm_aligned_alloc - C11 aligned_alloc, which is mm_memalign here.
+ */
+void *mm_aligned_alloc(size_t align, size_t size)
+{
+	return mm_memalign(align, size);
+}
+
+/*
+ * mm_calloc - Allocates n zeroed elements of size bytes, or NULL when the
+ * total overflows. Fresh heap and mapped pages are already zero, so only
+ * memory that was handed out before gets cleared.
+ */
+void *mm_calloc(size_t n, size_t size)
+{
+	void *ptr = calloc_any(n, size);
+
+	TRACE('m', ptr, NULL, n * size);
+	return ptr;
+}
+
+//Does the work of mm_calloc, clearing only what may be dirty.
+static void * calloc_any(size_t n, size_t size)
+{
+	struct tcache *tc;
+	struct arena *a;
+	size_t len;
+	size_t dirty;
+	size_t bin;
+	char *ptr;
+
+	if(size != 0 && n > SIZE_MAX / size){
+		return NULL;
+  }
+	if((len = n * size) == 0){
+		return NULL;
+  }
+	STAT_ADD(allocs[get_list(adjust_size(len))], 1);
+	if(len <= (size_t)slab_max && (ptr = slab_malloc(len)) != NULL)
+		{
+			memset(ptr, 0, len);
+			return ptr;
+		}
+	if(len > mmap_threshold){
+		return mmap_malloc(len);
+  }
+	size = adjust_size(len);
+	bin = size / DWORD;
+	tc = tcache_get();
+	if(tcache_limit > 0 && bin < TCACHE_BINS && (ptr = tc->bin[bin]) != NULL)
+		{
+			tc->bin[bin] = GET_PTR(ptr);
+			tc->count[bin]--;
+			memset(ptr, 0, len);
+			return ptr;
+		}
+	a = tc->arena;
+	pthread_mutex_lock(&a->lock);
+	ptr = heap_calloc(a, size, len, &dirty);
+	pthread_mutex_unlock(&a->lock);
+	if(ptr == NULL && a != &main_arena)
+		{
+			pthread_mutex_lock(&main_arena.lock);
+			ptr = heap_calloc(&main_arena, size, len, &dirty);
+			pthread_mutex_unlock(&main_arena.lock);
+		}
+	if(ptr != NULL){
+		clear_block(ptr, dirty);
+  }
+	return ptr;
+}
+
+/*
+ * mm_realloc - Resizes the block in place when it can, otherwise moves it
+ * within its arena or between the heap and its own mapping.
+ */
+void *mm_realloc(void *ptr, size_t size)
+{
+	void *new_ptr = realloc_any(ptr, size);
+
+	TRACE('r', new_ptr, ptr, size);
+	return new_ptr;
+}
+
+//Does the work of mm_realloc. A NULL ptr allocates, a zero size frees.
+static void * realloc_any(void *ptr, size_t size)
+{
+	struct arena *a;
+	void *new_ptr;
+
+	if(ptr == NULL){
+		return malloc_any(size);
+  }
+	if(size == 0)
 		{
-			size = 2 * 32;
+			free_any(ptr);
+			return NULL;
 		}
-	else
+	STAT_ADD(reallocs, 1);
+	//Slab slots keep their size; move out only when the slot is too small.
+	if(is_slab(ptr))
 		{
-			size = DWORD * ((size + (DWORD) + (DWORD-1)) / DWORD);
+			if(size <= slab_sizes[SLAB_RUN(ptr)->slab_class]){
+				return ptr;
+      }
 		}
-	void *next_ptr = NEXT_BLOCK(ptr);
-	size_t next_alloc = GET_ALLOC(HDRP(next_ptr));
-	size_t next_size = GET_SIZE(HDRP(next_ptr));
-  //Case 1: No change in size
-	if(size == old_size){
-		return ptr;
+	//Mapped blocks are remapped while they stay large, and move back into
+	//the heap once they shrink below the threshold.
+	else if(GET_MMAPPED(HDRP(ptr)))
+		{
+			if(size > mmap_threshold){
+				return mmap_realloc(ptr, size);
+      }
+		}
+	//Heap blocks that grow past the threshold move to a mapping of their own.
+	else if(size <= mmap_threshold)
+		{
+			a = arena_of(ptr);
+			pthread_mutex_lock(&a->lock);
+			new_ptr = heap_realloc(a, ptr, size);
+			pthread_mutex_unlock(&a->lock);
+			if(new_ptr != NULL){
+				return new_ptr;
+      }
+		}
+	//Move the block, copying only what the old payload holds.
+	if((new_ptr = malloc_any(size)) == NULL){
+		return NULL;
   }
-  //Case 2: Larger size. Block will grow.
-  else if(size > old_size)
-    {
-      if(!next_alloc && (next_size + old_size) > size)
-        {
-          remove_block(next_ptr);
-          PUT(HDRP(ptr), PACK((next_size + old_size), old_prev_alloc, 1));
-          next_ptr = NEXT_BLOCK(ptr);
-          next_size = GET_SIZE(HDRP(next_ptr));
-          PUT(HDRP(NEXT_BLOCK(ptr)), PACK(next_size, 2, 1));
-        }
-      else
-        {
-          new_ptr = mm_malloc(size);
-          if(new_ptr == NULL){
-            return NULL;
+	copy_block(new_ptr, ptr, MIN(payload_size(ptr), size));
+	free_any(ptr);
+	return new_ptr;
+}
+
+/*
+ * mm_malloc_batch - Allocates n blocks of size bytes into out, carving them
+ * from as few free blocks as it can. Returns how many were allocated, which
+ * is less than n only when memory runs out.
+ */
+size_t mm_malloc_batch(size_t size, size_t n, void **out)
+{
+	struct tcache *tc;
+	struct arena *a;
+	size_t done = 0;
+	void *ptr;
+
+	if(size == 0){
+		return 0;
+  }
+	//Slab and mapped sizes have no free blocks to carve.
+	if(size <= (size_t)slab_max || size > mmap_threshold)
+		{
+			while(done < n && (ptr = mm_malloc(size)) != NULL){
+				out[done++] = ptr;
+      }
+			return done;
+		}
+	size = adjust_size(size);
+	tc = tcache_get();
+	a = tc->arena;
+	pthread_mutex_lock(&a->lock);
+	done = heap_malloc_batch(a, size, n, out);
+	pthread_mutex_unlock(&a->lock);
+	if(done < n && a != &main_arena)
+		{
+			pthread_mutex_lock(&main_arena.lock);
+			done += heap_malloc_batch(&main_arena, size, n - done, out + done);
+			pthread_mutex_unlock(&main_arena.lock);
+		}
+	STAT_ADD(allocs[get_list(size)], done);
+#ifdef MM_TRACE
+	for(size_t i = 0; i < done; i++){
+		trace_event('m', out[i], NULL, size);
+  }
+#endif
+	return done;
+}
+
+/*
+ * mm_free_batch - Frees n blocks at once. Heap blocks are sorted by address
+ * so each run of neighbours is merged and coalesced once. The order of ptrs
+ * is not preserved.
+ */
+void mm_free_batch(void **ptrs, size_t n)
+{
+	struct arena *locked = NULL;
+	struct arena *a;
+	size_t heap_count = 0;
+	size_t run_size;
+	size_t i;
+	size_t j;
+	char *ptr;
+
+	for(i = 0; i < n; i++)
+		{
+			if((ptr = ptrs[i]) == NULL){
+				continue;
+      }
+			TRACE('f', ptr, NULL, 0);
+#ifdef MM_STATS
+			tcache_get();
+			STAT_ADD(frees[get_list(payload_size(ptr) + WSIZE)], 1);
+#endif
+			if(is_slab(ptr)){
+				slab_free(ptr);
+      }
+			else if(GET_MMAPPED(HDRP(ptr))){
+				mmap_free(ptr);
+      }
+			else{
+				ptrs[heap_count++] = ptr;
+      }
+		}
+	qsort(ptrs, heap_count, sizeof(*ptrs), ptr_compare);
+	for(i = 0; i < heap_count; i = j)
+		{
+			ptr = ptrs[i];
+			a = arena_of(ptr);
+			if(a != locked)
+				{
+					if(locked != NULL){
+						pthread_mutex_unlock(&locked->lock);
           }
-          memcpy(new_ptr, ptr, size);
-          mm_free(ptr);
-          return new_ptr;
-        }
-    }
-  //Case 3: Smaller size. Block will be split.
-  else if((0) && !next_alloc)
-    {
-      if((old_size - size) >(1<<30))
-        {
-          PUT(HDRP(ptr), PACK(size, GET_PREV_ALLOC(HDRP(ptr)), 1));
-          split_ptr = NEXT_BLOCK(ptr);
-          PUT(HDRP(split_ptr), PACK((old_size - size), 2, 1));
-          mm_free(split_ptr);
-        }
-    }
+					pthread_mutex_lock(&a->lock);
+					locked = a;
+				}
+			//Fold blocks that follow each other into one before freeing.
+			run_size = GET_SIZE(HDRP(ptr));
+			for(j = i + 1; j < heap_count && (char *)ptrs[j] == ptr + run_size; j++){
+				run_size += GET_SIZE(HDRP(ptrs[j]));
+      }
+			if(j == i + 1)
+				{
+					arena_free(a, ptr);
+					continue;
+				}
+			PUT(HDRP(ptr), PACK(run_size, GET_PREV_ALLOC(HDRP(ptr)), 1));
+			heap_free(a, ptr);
+		}
+	if(locked != NULL){
+		pthread_mutex_unlock(&locked->lock);
+  }
+}
+
+/*
+ * mm_stats - Fills in the counters: per-thread counters summed over live and
+ * exited threads, and per-arena ones summed over every arena. Counters are
+ * cumulative and only kept in MM_STATS builds; the free bytes per list and
+ * the used blocks, from a walk of every heap, are measured on every call.
+ */
+void mm_stats(struct mm_stats *stats)
+{
+#ifdef MM_STATS
+	struct tcache *tc;
+#endif
+	struct heap_walk w;
+	struct arena *a;
+	char *ptr;
+	int list;
+	int i;
+	int k;
+
+	memset(stats, 0, sizeof(*stats));
+#ifdef MM_STATS
+	pthread_mutex_lock(&stats_lock);
+	stats_add(stats, &stats_retired);
+	stats_add(stats, &stats_shared);
+	for(tc = stats_threads; tc != NULL; tc = tc->next){
+		stats_add(stats, &tc->stats);
+  }
+	pthread_mutex_unlock(&stats_lock);
+#endif
+	pthread_mutex_lock(&arena_lock);
+	for(i = 0; i < MAX_ARENAS; i++)
+		{
+			if((a = arenas[i]) == NULL){
+				continue;
+      }
+			pthread_mutex_lock(&a->lock);
+			//Frees queued to an arena nobody allocates from would stay
+			//stranded until the next malloc there.
+			remote_drain(a);
+			stats->defer_frees += a->defer_frees;
+			stats->defer_hits += a->defer_hits;
+			stats->defer_flushes += a->defer_flushes;
+			stats->defer_flushed += a->defer_flushed;
+			stats->remote_drains += a->remote_drains;
+			stats->remote_drained += a->remote_drained;
+			stats->purges += a->purges;
+			stats->purged_bytes += a->purged_bytes;
+			stats->dirty_bytes += a->dirty_bytes;
+			for(list = 0; list < MAX_LISTS && list < MM_STAT_LISTS; list++)
+				{
+					for(ptr = GET_ROOT(a, list); ptr != NULL; ptr = NEXT_FLIST_ADDRESS(a, ptr)){
+						stats->free_bytes[list] += GET_SIZE(HDRP(ptr));
+          }
+				}
+			w.a = a;
+			w.top = a->heap_brk;
+			w.fn = walk_used;
+			if(heap_walk(&w) != NULL)
+				{
+					for(k = 0; k < w.count; k++)
+						{
+							stats->used_blocks += w.range[k].blocks;
+							stats->used_bytes += w.range[k].bytes;
+						}
+				}
+			pthread_mutex_unlock(&a->lock);
+		}
+	pthread_mutex_unlock(&arena_lock);
+}
+
+#ifdef MM_STATS
+//Adds one thread's counters to a sum. The arena counters are not kept per
+//thread and are left alone.
+static void stats_add(struct mm_stats *sum, const struct mm_stats *part)
+{
+	int i;
+
+	for(i = 0; i < MM_STAT_LISTS; i++)
+		{
+			sum->allocs[i] += part->allocs[i];
+			sum->frees[i] += part->frees[i];
+			sum->probes[i] += part->probes[i];
+			sum->splits[i] += part->splits[i];
+		}
+	for(i = 0; i < 4; i++){
+		sum->coalesce[i] += part->coalesce[i];
+  }
+	sum->reallocs += part->reallocs;
+	sum->extend_calls += part->extend_calls;
+	sum->extend_bytes += part->extend_bytes;
+	sum->remote_frees += part->remote_frees;
+}
+#endif
+
+#ifdef MM_TRACE
+//Logs one call in the trace ring, overwriting the oldest event once full.
+static void trace_event(char op, void *ptr, void *old, size_t size)
+{
+	struct trace_event *e;
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	e = &trace_ring[__atomic_fetch_add(&trace_next, 1, __ATOMIC_RELAXED) % TRACE_EVENTS];
+	e->ns = (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	e->op = op;
+	e->ptr = ptr;
+	e->old = old;
+	e->size = size;
+}
+#endif
+
+/*
+ * mm_trace_dump - Writes the traced calls, oldest first, one per line:
+ * "<ns> m <ptr> <size>", "<ns> f <ptr>" or "<ns> r <ptr> <old> <size>",
+ * pointers in hex with NULL as 0.
+ * Returns the number of events written, or -1 in builds without MM_TRACE.
+ * Call it while no other thread is allocating.
+ */
+long mm_trace_dump(FILE *f)
+{
+#ifdef MM_TRACE
+	unsigned long end = __atomic_load_n(&trace_next, __ATOMIC_ACQUIRE);
+	unsigned long i = (end > TRACE_EVENTS) ? end - TRACE_EVENTS : 0;
+	struct trace_event *e;
+	long count = 0;
+
+	for(; i < end; i++, count++)
+		{
+			e = &trace_ring[i % TRACE_EVENTS];
+			if(e->op == 'm'){
+				fprintf(f, "%llu m %#lx %zu\n", e->ns, (unsigned long)e->ptr, e->size);
+      }
+			else if(e->op == 'f'){
+				fprintf(f, "%llu f %#lx\n", e->ns, (unsigned long)e->ptr);
+      }
+			else{
+				fprintf(f, "%llu r %#lx %#lx %zu\n", e->ns, (unsigned long)e->ptr, (unsigned long)e->old, e->size);
+      }
+		}
+	return count;
+#else
+	(void)f;
+	return -1;
+#endif
+}
+
+/*
+ * mm_footprint - Gets the bytes the allocator holds from the system: every
+ * arena up to its break, the slab runs handed out and the live mappings.
+ */
+size_t mm_footprint(void)
+{
+	struct arena *a;
+	size_t bytes;
+	int i;
+
+	pthread_mutex_lock(&arena_lock);
+	pthread_mutex_lock(&mmap_lock);
+	bytes = mmap_bytes;
+	pthread_mutex_unlock(&mmap_lock);
+	pthread_mutex_lock(&slab_lock);
+	if(slab_lo != NULL){
+		bytes += slab_brk - slab_lo;
+  }
+	pthread_mutex_unlock(&slab_lock);
+	for(i = 0; i < MAX_ARENAS; i++)
+		{
+			if((a = arenas[i]) == NULL){
+				continue;
+      }
+			pthread_mutex_lock(&a->lock);
+			bytes += a->heap_brk - a->heap_lo;
+			pthread_mutex_unlock(&a->lock);
+		}
+	pthread_mutex_unlock(&arena_lock);
+	return bytes;
+}
+
+/*
+ * mm_checkheap - Checks every arena at an MM_CHECK_* level, reporting each
+ * problem on stderr. Returns 0 for a sound heap, -1 otherwise.
+ */
+int mm_checkheap(int level)
+{
+	struct arena *a;
+	int errors = 0;
+	int i;
+
+	pthread_mutex_lock(&arena_lock);
+	for(i = 0; i < MAX_ARENAS; i++)
+		{
+			if((a = arenas[i]) == NULL){
+				continue;
+      }
+			pthread_mutex_lock(&a->lock);
+			errors += arena_check(a, level);
+			pthread_mutex_unlock(&a->lock);
+		}
+	pthread_mutex_unlock(&arena_lock);
+	return (errors == 0) ? 0 : -1;
+}
+
+//Sets up a heap's lock, shared across processes mapping its region.
+static void pool_lock_init(struct arena *a)
+{
+	pthread_mutexattr_t attr;
+
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutex_init(&a->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+}
+
+//Builds an empty pool heap with its arena at lo, a DWORD multiple, and its
+//end at hi, or returns NULL when that is too small.
+static struct arena * pool_init(char *lo, char *hi)
+{
+	struct arena *a = (struct arena *)lo;
+
+	if(hi < lo || (size_t)(hi - lo) < ARENA_HEADER + PROLOGUE_OFFSET + DWORD + CHUNKSIZE){
+		return NULL;
+  }
+	memset(a, 0, sizeof(*a));
+	pool_lock_init(a);
+	a->pool = 1;
+	a->node = -1;
+	a->heap_lo = lo + ARENA_HEADER;
+	a->heap_brk = a->heap_lo;
+	a->heap_limit = hi;
+	if(arena_init(a) < 0){
+		return NULL;
+  }
+	return a;
+}
+
+/*
+ * mm_heap_create - Builds an independent heap in the len bytes at base and
+ * returns its handle, or NULL when the region is too small. The handle
+ * lives at the start of the region, which the caller keeps mapped for the
+ * heap's lifetime. Its blocks go back through mm_heap_free, never mm_free.
+ * The heap follows the options of the last mm_init_opts, so a heap is
+ * created or reset after it. Processes sharing the region must map it at
+ * the same address, since the heap keeps absolute pointers to itself.
+ */
+struct mm_heap *mm_heap_create(void *base, size_t len)
+{
+	char *lo = (char *)(((uintptr_t)base + DWORD - 1) & ~(uintptr_t)(DWORD - 1));
+	char *hi = (char *)(((uintptr_t)base + len) & ~(uintptr_t)(DWORD - 1));
+
+	//The size classes are only laid out once mm_init_opts has run.
+	if(heap_generation == 0 || base == NULL){
+		return NULL;
+  }
+	return (struct mm_heap *)pool_init(lo, hi);
+}
+
+/*
+ * mm_heap_malloc - Allocates a block of at least size bytes from heap.
+ */
+void *mm_heap_malloc(struct mm_heap *heap, size_t size)
+{
+	struct arena *a = (struct arena *)heap;
+	char *ptr;
+
+	if(size == 0){
+		return NULL;
+  }
+	pthread_mutex_lock(&a->lock);
+	ptr = heap_malloc(a, adjust_size(size));
+	pthread_mutex_unlock(&a->lock);
+	return ptr;
+}
+
+/*
+ * mm_heap_free - Frees a block mm_heap_malloc or mm_heap_realloc gave out.
+ */
+void mm_heap_free(struct mm_heap *heap, void *ptr)
+{
+	struct arena *a = (struct arena *)heap;
+
+	if(ptr == NULL){
+		return;
+  }
+	pthread_mutex_lock(&a->lock);
+	arena_free(a, ptr);
+	pthread_mutex_unlock(&a->lock);
+}
+
+/*
+ * mm_heap_realloc - Resizes a block of heap in place when it can, moving
+ * it within the heap otherwise.
+ */
+void *mm_heap_realloc(struct mm_heap *heap, void *ptr, size_t size)
+{
+	struct arena *a = (struct arena *)heap;
+	char *new_ptr;
+
+	if(ptr == NULL){
+		return mm_heap_malloc(heap, size);
+  }
+	if(size == 0)
+		{
+			mm_heap_free(heap, ptr);
+			return NULL;
+		}
+	pthread_mutex_lock(&a->lock);
+	if((new_ptr = heap_realloc(a, ptr, size)) == NULL &&
+	   (new_ptr = heap_malloc(a, adjust_size(size))) != NULL)
+		{
+			copy_block(new_ptr, ptr, MIN(GET_SIZE(HDRP(ptr)) - WSIZE, size));
+			arena_free(a, ptr);
+		}
+	pthread_mutex_unlock(&a->lock);
 	return new_ptr;
 }
+
+/*
+ * mm_heap_reset - Frees every block of heap at once and clears its root.
+ * Only the list heads and the first chunk are rebuilt, whatever the heap
+ * held.
+ */
+int mm_heap_reset(struct mm_heap *heap)
+{
+	struct arena *a = (struct arena *)heap;
+	int ret;
+
+	pthread_mutex_lock(&a->lock);
+	a->root = 0;
+	ret = arena_init(a);
+	pthread_mutex_unlock(&a->lock);
+	return ret;
+}
+
+/*
+ * mm_heap_set_root - Records ptr, a block of heap or NULL, as the heap's
+ * root. The root is kept as an offset, so a heap file finds it again after
+ * it is reopened at another address.
+ */
+void mm_heap_set_root(struct mm_heap *heap, void *ptr)
+{
+	struct arena *a = (struct arena *)heap;
+
+	a->root = (ptr == NULL) ? 0 : (size_t)((char *)ptr - (char *)a);
+}
+
+/*
+ * mm_heap_root - Gets the block last passed to mm_heap_set_root, or NULL.
+ */
+void *mm_heap_root(struct mm_heap *heap)
+{
+	struct arena *a = (struct arena *)heap;
+
+	return (a->root == 0) ? NULL : (char *)a + a->root;
+}
+
+//Gets a signature of everything a heap file's lists and blocks depend on,
+//so a file written under other options or another build is rebuilt before
+//use.
+static unsigned int heap_layout(void)
+{
+	return (unsigned int)WSIZE | (unsigned int)sorted_from << 8 |
+	       (unsigned int)purge_from << 16 | (unsigned int)(sizeof(struct arena) & 0xff) << 24;
+}
+
+//Rebuilds the blocks of one range of a recovered heap: rewrites headers,
+//free footers and prev-alloc bits, merges touching free blocks, and lists
+//the free ones per class in the range, in address order.
+static int walk_rebuild(struct heap_walk *w, struct walk_range *r)
+{
+	size_t prev_alloc = r->prev_free ? 0 : 2;
+	size_t size;
+	char *ptr;
+	int list;
+
+	(void)w;
+	for(ptr = r->start; ptr != r->end; ptr += size)
+		{
+			size = GET_SIZE(HDRP(ptr));
+			if(GET_ALLOC(HDRP(ptr)))
+				{
+					PUT(HDRP(ptr), PACK(size, prev_alloc, 1));
+					prev_alloc = 2;
+					continue;
+				}
+			while(ptr + size != r->end && !GET_ALLOC(HDRP(ptr + size))){
+				size += GET_SIZE(HDRP(ptr + size));
+      }
+			PUT(HDRP(ptr), PACK(size, prev_alloc, 0));
+			PUT(FTRP(ptr), PACK(size, prev_alloc, 0));
+			list = get_list(size);
+			PUT_LINK(w->a, NEXT_ADDRESS(ptr), NULL);
+			PUT_LINK(w->a, PREV_ADDRESS(ptr), r->tail[list]);
+			if(r->tail[list] == NULL){
+				r->head[list] = ptr;
+      }
+			else{
+				PUT_LINK(w->a, NEXT_ADDRESS(r->tail[list]), ptr);
+      }
+			r->tail[list] = ptr;
+			prev_alloc = 0;
+		}
+	return 0;
+}
+
+//Rebuilds the free lists of a recovered heap from its blocks alone, walking
+//from the prologue to the first zero-size header, which becomes the
+//epilogue. Free footers and prev-alloc bits are rewritten and touching
+//free blocks merged, which repairs what a crash mid-operation leaves
+//behind. Deferred blocks are lost as allocated. The ranges of a large heap
+//are rebuilt in parallel and their lists joined in address order; sorted
+//classes are inserted one block at a time. Returns -1 when a header is
+//damaged. Caller holds the arena lock.
+static int arena_rebuild(struct arena *a)
+{
+	struct heap_walk w;
+	struct walk_range *r;
+	char *block;
+	char *ptr;
+	char *next;
+	char *tail;
+	int list;
+	int i;
+
+	a->fl_bitmap = 0;
+	memset(a->sl_bitmap, 0, sizeof(a->sl_bitmap));
+	memset(a->tree, 0, sizeof(a->tree));
+	memset(a->quick, 0, sizeof(a->quick));
+	a->quick_count = 0;
+	a->dirty_bytes = 0;
+	a->remote = NULL;
+	a->trim_size = 0;
+	for(i = 0; i < 2 * MAX_LISTS; i++){
+		PUT(a->free_start + (i * WSIZE), 0);
+  }
+	w.a = a;
+	w.top = a->heap_limit;
+	w.fn = walk_rebuild;
+	if((ptr = heap_walk(&w)) == NULL){
+		return -1;
+  }
+	for(list = 0; list < MAX_LISTS; list++)
+		{
+			for(i = 0; i < w.count; i++)
+				{
+					r = &w.range[i];
+					if(r->head[list] == NULL){
+						continue;
+          }
+					if(list >= sorted_from)
+						{
+							for(next = r->head[list]; (block = next) != NULL; )
+								{
+									next = NEXT_FLIST_ADDRESS(a, block);
+									add_block(a, block);
+								}
+							continue;
+						}
+					if((tail = GET_TAIL(a, list)) == NULL)
+						{
+							SET_ROOT(a, list, r->head[list]);
+							set_list_bit(a, list);
+						}
+					else
+						{
+							PUT_LINK(a, NEXT_ADDRESS(tail), r->head[list]);
+							PUT_LINK(a, PREV_ADDRESS(r->head[list]), tail);
+						}
+					SET_TAIL(a, list, r->tail[list]);
+				}
+		}
+	PUT(HDRP(ptr), PACK(0, w.range[w.count - 1].last_free ? 0 : 2, 1));
+	a->heap_epilogue = HDRP(ptr);
+	a->heap_brk = HDRP(ptr) + WSIZE;
+	return 0;
+}
+
+/*
+ * mm_heap_open - Opens the heap file at path, creating it with len bytes
+ * when it does not exist, and returns its handle or NULL. A file closed
+ * cleanly by mm_heap_close, written under the same options and mapped
+ * back at the same address (or in an MM_COMPACT build, where links are
+ * offsets) is used as it is. Any other is recovered by rebuilding its free
+ * lists from its blocks. A len larger than the file grows it.
+ */
+struct mm_heap *mm_heap_open(const char *path, size_t len)
+{
+	struct heap_file hdr;
+	struct heap_file *f;
+	struct arena *a;
+	struct stat st;
+	char *map;
+	char *hi;
+	intptr_t delta;
+	int fresh;
+	int fd;
+
+	if(heap_generation == 0 || (fd = open(path, O_RDWR | O_CREAT, 0600)) < 0){
+		return NULL;
+  }
+	if(fstat(fd, &st) < 0)
+		{
+			close(fd);
+			return NULL;
+		}
+	fresh = (st.st_size == 0);
+	memset(&hdr, 0, sizeof(hdr));
+	if(!fresh && (pread(fd, &hdr, sizeof(hdr), 0) != (ssize_t)sizeof(hdr) || hdr.magic != HEAP_FILE_MAGIC))
+		{
+			//Not a heap file; leave it alone.
+			close(fd);
+			return NULL;
+		}
+	len = MAX(len, (size_t)st.st_size);
+	if((size_t)st.st_size < len && ftruncate(fd, len) < 0)
+		{
+			close(fd);
+			return NULL;
+		}
+	//Ask for the last address first, so a clean file needs no rebuild.
+	map = mmap(hdr.base, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED){
+		return NULL;
+  }
+	f = (struct heap_file *)map;
+	hi = (char *)(((uintptr_t)map + len) & ~(uintptr_t)(DWORD - 1));
+	if(fresh)
+		{
+			if((a = pool_init(map + HEAP_FILE_HEADER, hi)) == NULL)
+				{
+					munmap(map, len);
+					return NULL;
+				}
+			f->magic = HEAP_FILE_MAGIC;
+			f->version = HEAP_FILE_VERSION;
+		}
+	else
+		{
+			//Move the arena's pointers to where the file is mapped now.
+			a = (struct arena *)(map + HEAP_FILE_HEADER);
+			delta = map - hdr.base;
+			a->free_start += delta;
+			a->heap_prologue += delta;
+			a->heap_epilogue += delta;
+			a->heap_lo += delta;
+			a->heap_brk += delta;
+			a->heap_limit = hi;
+			a->zero_lo = hi;
+			pool_lock_init(a);
+			if(f->version != HEAP_FILE_VERSION || !f->clean || f->layout != heap_layout() ||
+#ifdef MM_COMPACT
+			   0
+#else
+			   delta != 0
+#endif
+			   )
+				{
+					if(arena_rebuild(a) < 0)
+						{
+							munmap(map, len);
+							return NULL;
+						}
+					f->version = HEAP_FILE_VERSION;
+				}
+		}
+	a->file = map;
+	a->file_len = len;
+	f->base = map;
+	f->layout = heap_layout();
+	//The file reads as unclean until it is closed, even if the process dies.
+	f->clean = 0;
+	msync(map, HEAP_FILE_HEADER, MS_SYNC);
+	return (struct mm_heap *)a;
+}
+
+/*
+ * mm_heap_close - Coalesces the deferred blocks of a heap from
+ * mm_heap_open, marks the file clean, writes it out and unmaps it.
+ * Returns -1 for a heap that is not backed by a file.
+ */
+int mm_heap_close(struct mm_heap *heap)
+{
+	struct arena *a = (struct arena *)heap;
+	struct heap_file *f;
+	char *map = a->file;
+	size_t len = a->file_len;
+
+	if(map == NULL){
+		return -1;
+  }
+	f = (struct heap_file *)map;
+	pthread_mutex_lock(&a->lock);
+	if(a->quick_count > 0){
+		quick_flush(a);
+  }
+	f->clean = 1;
+	pthread_mutex_unlock(&a->lock);
+	msync(map, len, MS_SYNC);
+	munmap(map, len);
+	return 0;
+}
+
+/*
+ * mm_heap_check - mm_checkheap for one heap made by mm_heap_create or
+ * mm_heap_open.
+ */
+int mm_heap_check(struct mm_heap *heap, int level)
+{
+	struct arena *a = (struct arena *)heap;
+	int errors;
+
+	pthread_mutex_lock(&a->lock);
+	errors = arena_check(a, level);
+	pthread_mutex_unlock(&a->lock);
+	return (errors == 0) ? 0 : -1;
+}
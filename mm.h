@@ -1,6 +1,100 @@
 #include <stdio.h>
 
+//Free list insertion policies for mm_init_opts
+#define MM_INSERT_ADDRESS  0	//Keep each free list sorted by address
+#define MM_INSERT_LIFO     1	//Push freed blocks at the list root
+#define MM_INSERT_FIFO     2	//Append freed blocks at the list tail
+
+//Page backing for the heaps, for mm_options.huge_pages
+#define MM_HUGE_NONE  0	//Normal pages
+#define MM_HUGE_THP   1	//Transparent huge pages over 2 MB aligned extensions
+#define MM_HUGE_TLB   2	//hugetlbfs pages for mapped arenas, else as MM_HUGE_THP
+
+//Heap check levels for mm_checkheap and mm_options.check_level
+#define MM_CHECK_CHEAP   1	//Prologue, epilogue, list roots and bitmap index
+#define MM_CHECK_MEDIUM  2	//Also walks every free list
+#define MM_CHECK_FULL    3	//Also walks every block in the heap
+
+//Options for mm_init_opts. A zeroed field selects its default.
+struct mm_options {
+	int insert_policy;	//One of MM_INSERT_*
+	int fit_scan;		//Fitting blocks find_fit compares per class, 1 = first fit
+	long sorted_min;	//Classes of free blocks this large are indexed by size, -1 = none
+	int split_shift;	//Leftovers under 1/2^split_shift of the class size are not split off
+	long high_min;		//Requests this large go at the high end of a free block, 0 = never
+	int tcache_count;	//Blocks each thread caches per size, -1 = no cache
+	int arenas;		//Arenas threads are spread over, default one per CPU
+	int numa;		//1 binds arenas to NUMA nodes, -1 never, default when multi-node
+	int slab_max;		//Largest request served from slabs, -1 = no slabs
+	long mmap_threshold;	//Requests above this get their own mapping, -1 = never
+	long grow_max;		//Largest heap extension, 256 or less keeps it fixed
+	long trim_threshold;	//Trailing free bytes that get trimmed, -1 = never
+	int huge_pages;		//One of MM_HUGE_*
+	long purge_limit;	//Unpurged bytes in large free blocks an arena keeps, -1 = never purge
+	int remote_queue;	//-1 frees into other threads' arenas under their lock
+	int defer_limit;	//Freed blocks an arena holds before coalescing, 0 = never defer
+	int walk_threads;	//Threads a heap walk is split over, default one per CPU, 1 = serial
+	int check_every;	//Heap operations between sampled checks, -1 = never
+	int check_level;	//MM_CHECK_* level of sampled checks, default full
+};
+
+//Size classes mm_stats reports on, one per free list
+#define MM_STAT_LISTS  64
+
+//Allocator counters filled in by mm_stats. Fields marked MM_STATS stay zero
+//unless mm.c is built with MM_STATS.
+struct mm_stats {
+	unsigned long allocs[MM_STAT_LISTS];	//Allocations per size class, MM_STATS
+	unsigned long frees[MM_STAT_LISTS];	//Frees per size class, MM_STATS
+	unsigned long probes[MM_STAT_LISTS];	//Free blocks find_fit looked at, MM_STATS
+	unsigned long splits[MM_STAT_LISTS];	//Blocks place split, MM_STATS
+	unsigned long coalesce[4];	//Coalesce cases 1-4 as numbered in mm.c, MM_STATS
+	unsigned long reallocs;		//Reallocs of a live block, MM_STATS
+	unsigned long extend_calls;	//Heap extensions, MM_STATS
+	unsigned long extend_bytes;	//Bytes the heap was extended by, MM_STATS
+	unsigned long remote_frees;	//Frees of blocks from another node's arena, MM_STATS
+	size_t free_bytes[MM_STAT_LISTS];	//Bytes now free in each list
+	unsigned long defer_frees;	//Frees whose coalesce was deferred
+	unsigned long defer_hits;	//Mallocs served by a deferred block
+	unsigned long defer_flushes;	//Batches of deferred blocks coalesced
+	unsigned long defer_flushed;	//Deferred blocks coalesced in batches
+	unsigned long remote_drains;	//Batches of queued cross-thread frees drained
+	unsigned long remote_drained;	//Cross-thread frees drained from the queues
+	unsigned long purges;		//Free blocks whose pages were given back
+	size_t purged_bytes;		//Bytes given back by purging
+	size_t dirty_bytes;		//Bytes now in large free blocks not yet purged
+	unsigned long used_blocks;	//Allocated heap blocks, from a walk of every heap
+	size_t used_bytes;		//Bytes in them
+};
+
+//Handle of a heap in caller memory, from mm_heap_create. Its lock works
+//across processes, but the heap keeps absolute pointers to itself, so
+//processes sharing one heap must all map its region at the same address.
+struct mm_heap;
+
 extern int mm_init (void);
+extern int mm_init_opts (const struct mm_options *opts);
 extern void *mm_malloc (size_t size);
+extern void *mm_malloc_onnode (size_t size, int node);
 extern void mm_free (void *ptr);
+extern void mm_free_sized (void *ptr, size_t size);
+extern void *mm_calloc (size_t n, size_t size);
+extern void *mm_memalign (size_t align, size_t size);
+extern void *mm_aligned_alloc (size_t align, size_t size);
 extern void *mm_realloc(void *ptr, size_t size);
+extern size_t mm_malloc_batch(size_t size, size_t n, void **out);
+extern void mm_free_batch(void **ptrs, size_t n);
+extern void mm_stats(struct mm_stats *stats);
+extern size_t mm_footprint(void);
+extern int mm_checkheap(int level);
+extern long mm_trace_dump(FILE *f);
+extern struct mm_heap *mm_heap_create(void *base, size_t len);
+extern void *mm_heap_malloc(struct mm_heap *heap, size_t size);
+extern void mm_heap_free(struct mm_heap *heap, void *ptr);
+extern void *mm_heap_realloc(struct mm_heap *heap, void *ptr, size_t size);
+extern int mm_heap_reset(struct mm_heap *heap);
+extern void mm_heap_set_root(struct mm_heap *heap, void *ptr);
+extern void *mm_heap_root(struct mm_heap *heap);
+extern struct mm_heap *mm_heap_open(const char *path, size_t len);
+extern int mm_heap_close(struct mm_heap *heap);
+extern int mm_heap_check(struct mm_heap *heap, int level);
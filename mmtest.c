@@ -0,0 +1,713 @@
+/*
+ * mmtest.c - Behavior and regression tests for the allocator. Each test runs
+ * against a fresh mm_init_opts and fails loudly on the first bad result.
+ *
+ * Usage: mmtest
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "mm.h"
+#include "memlib.h"
+
+//Reports a failed check and exits.
+#define CHECK(cond, msg) \
+	do { \
+		if(!(cond)) \
+			{ \
+				fprintf(stderr, "mmtest: %s: %s\n", __func__, (msg)); \
+				exit(1); \
+			} \
+	} while(0)
+
+//Initializes the heap with a test's options.
+static void init(struct mm_options *opts)
+{
+	CHECK(mm_init_opts(opts) == 0, "mm_init_opts failed");
+}
+
+//Grows a mapped arena a block at a time. After each block a small free
+//purges the trailing free block, and a calloc is then carved from it, with
+//the block's treap links and purge mark in pages calloc trusts to be zero.
+//Then callocs lengths that are not whole words.
+static void *calloc_worker(void *arg)
+{
+	char *blocks[32];
+	char *small;
+	char *ptr;
+	size_t i;
+	int n;
+
+	(void)arg;
+	for(n = 0; n < 32; n++)
+		{
+			CHECK((blocks[n] = mm_malloc(200000)) != NULL, "malloc failed");
+			CHECK((small = mm_malloc(64)) != NULL, "malloc failed");
+			mm_free(small);
+			CHECK((ptr = mm_calloc(1, 100000)) != NULL, "calloc failed");
+			for(i = 0; i < 100000; i++){
+				CHECK(ptr[i] == 0, "calloc returned a non-zero byte");
+      }
+			memset(ptr, 0xa5, 100000);
+			mm_free(ptr);
+		}
+	//Lengths that are not whole words end the payload mid-word.
+	for(n = 0; n < 32; n++)
+		{
+			CHECK((ptr = mm_calloc(1, 5000 + n)) != NULL, "calloc failed");
+			for(i = 0; i < (size_t)(5000 + n); i++){
+				CHECK(ptr[i] == 0, "calloc returned a non-zero byte");
+      }
+			small = ptr;
+			CHECK((ptr = mm_malloc(200000)) != NULL, "malloc failed");
+			mm_free(small);
+			mm_free(ptr);
+		}
+	for(n = 0; n < 32; n++){
+		mm_free(blocks[n]);
+  }
+	return NULL;
+}
+
+//Callocs from a second thread, which lands on a freshly mapped arena whose
+//pages calloc trusts to be zero. Slabs and mappings are off so every block
+//comes from the arena.
+static void test_calloc_mapped(void)
+{
+	struct mm_options opts = {0};
+	pthread_t thread;
+
+	opts.arenas = 2;
+	opts.tcache_count = -1;
+	opts.purge_limit = 1;
+	opts.slab_max = -1;
+	opts.mmap_threshold = -1;
+	init(&opts);
+	//The first thread to allocate takes the main arena, the next a mapped one.
+	mm_free(mm_malloc(64));
+	CHECK(pthread_create(&thread, NULL, calloc_worker, NULL) == 0, "pthread_create failed");
+	pthread_join(thread, NULL);
+	CHECK(mm_checkheap(MM_CHECK_FULL) == 0, "heap check failed");
+}
+
+//Allocates blocks at every alignment next to plain ones, frees them in an
+//interleaved order, and runs the full checker after each pass.
+static void test_memalign(void)
+{
+	static char *blocks[512];
+	size_t align;
+	size_t size;
+	int i;
+
+	init(NULL);
+	for(i = 0; i < 512; i++)
+		{
+			align = (size_t)1 << (i % 13);
+			size = (size_t)(i * 37 % 3000) + 1;
+			if(i % 3 == 0)
+				{
+					CHECK((blocks[i] = mm_malloc(size)) != NULL, "malloc failed");
+					continue;
+				}
+			CHECK((blocks[i] = mm_memalign(align, size)) != NULL, "memalign failed");
+			CHECK(((uintptr_t)blocks[i] & (align - 1)) == 0, "memalign block is misaligned");
+			memset(blocks[i], 0x5a, size);
+		}
+	CHECK(mm_checkheap(MM_CHECK_FULL) == 0, "heap check failed after memalign");
+	for(i = 0; i < 512; i += 2){
+		mm_free(blocks[i]);
+  }
+	CHECK(mm_checkheap(MM_CHECK_FULL) == 0, "heap check failed after frees");
+	for(i = 1; i < 512; i += 2){
+		mm_free(blocks[i]);
+  }
+	CHECK(mm_checkheap(MM_CHECK_FULL) == 0, "heap check failed after all frees");
+}
+
+//Frees large memalign blocks and large mallocs, both mapped, through
+//mm_free_sized. A block sent down the wrong path would leak, so the
+//footprint would keep growing.
+static void test_free_sized(void)
+{
+	size_t footprint = 0;
+	size_t size = (size_t)1 << 20;
+	char *ptr;
+	int i;
+
+	init(NULL);
+	for(i = 0; i < 64; i++)
+		{
+			CHECK((ptr = mm_memalign(4096, size)) != NULL, "memalign failed");
+			memset(ptr, 0x5a, size);
+			mm_free_sized(ptr, size);
+			CHECK((ptr = mm_malloc(size)) != NULL, "malloc failed");
+			mm_free_sized(ptr, size);
+			if(i == 0){
+				footprint = mm_footprint();
+      }
+		}
+	CHECK(mm_footprint() <= footprint, "sized frees leaked heap blocks");
+	CHECK(mm_checkheap(MM_CHECK_FULL) == 0, "heap check failed");
+}
+
+//Asks memalign for more than mem_sbrk's int can hold. Large requests get
+//an aligned mapping, and with mappings off the heap must refuse the
+//request rather than grow by a truncated size and damage itself.
+static void test_memalign_large(void)
+{
+	struct mm_options opts = {0};
+	size_t size = ((size_t)1 << 32) + 8192;
+	size_t align;
+	char *ptr;
+	char *next;
+
+	init(NULL);
+	for(align = 64; align <= ((size_t)1 << 22); align <<= 6)
+		{
+			CHECK((ptr = mm_memalign(align, size)) != NULL, "memalign failed");
+			CHECK(((uintptr_t)ptr & (align - 1)) == 0, "memalign block is misaligned");
+			ptr[0] = 1;
+			ptr[size - 1] = 1;
+			CHECK((ptr = mm_realloc(ptr, size + 8192)) != NULL, "realloc failed");
+			CHECK(ptr[0] == 1 && ptr[size - 1] == 1, "realloc lost the payload");
+			mm_free(ptr);
+		}
+	CHECK((next = mm_malloc(100000)) != NULL, "malloc failed");
+	mm_free(next);
+	CHECK(mm_checkheap(MM_CHECK_FULL) == 0, "heap check failed");
+
+	opts.mmap_threshold = -1;
+	init(&opts);
+	//Compact builds still map requests their headers cannot describe.
+	ptr = mm_memalign(64, size);
+	CHECK(ptr == NULL || ((uintptr_t)ptr & 63) == 0, "memalign block is misaligned");
+	CHECK((next = mm_malloc(100000)) != NULL, "malloc failed");
+	memset(next, 0x5a, 100000);
+	mm_free(next);
+	if(ptr == NULL){
+		CHECK(mm_malloc(size) == NULL, "malloc took a truncated size");
+  }
+	mm_free(ptr);
+	CHECK(mm_checkheap(MM_CHECK_FULL) == 0, "heap check failed");
+}
+
+//Allocates a block on the thread's own arena and hands it back.
+static void *remote_worker(void *arg)
+{
+	char **out = arg;
+
+	CHECK((*out = mm_malloc(1000)) != NULL, "malloc failed");
+	return NULL;
+}
+
+//Frees blocks from arenas whose threads have exited. The frees are queued
+//to those arenas, and mm_stats must drain them even though nobody
+//allocates there again.
+static void test_remote_drain(void)
+{
+	struct mm_options opts = {0};
+	struct mm_stats stats;
+	pthread_t thread;
+	char *ptr;
+
+	opts.arenas = 2;
+	opts.tcache_count = -1;
+	opts.slab_max = -1;
+	init(&opts);
+	mm_free(mm_malloc(64));
+	CHECK(pthread_create(&thread, NULL, remote_worker, &ptr) == 0, "pthread_create failed");
+	pthread_join(thread, NULL);
+	mm_free(ptr);
+	mm_stats(&stats);
+	CHECK(stats.remote_drained == 1, "queued free was not drained");
+	CHECK(mm_checkheap(MM_CHECK_FULL) == 0, "heap check failed");
+}
+
+//Sums a per-class counter of mm_stats.
+static unsigned long stat_sum(const unsigned long *counts)
+{
+	unsigned long sum = 0;
+	int i;
+
+	for(i = 0; i < MM_STAT_LISTS; i++){
+		sum += counts[i];
+  }
+	return sum;
+}
+
+//Splits blocks of a pool heap from a thread that never touches mm_malloc.
+static void *pool_worker(void *arg)
+{
+	struct mm_heap *heap = arg;
+	int i;
+
+	for(i = 0; i < 100; i++){
+		CHECK(mm_heap_malloc(heap, 100) != NULL, "pool malloc failed");
+  }
+	return NULL;
+}
+
+//Counts pool heap work done by a thread with no registered cache. Only
+//MM_STATS builds count, so other builds skip the test.
+static void test_stats_unregistered(void)
+{
+	static char region[1 << 20];
+	struct mm_stats before;
+	struct mm_stats after;
+	struct mm_heap *heap;
+	pthread_t thread;
+
+	init(NULL);
+	mm_free(mm_malloc(100));
+	mm_stats(&before);
+	if(stat_sum(before.allocs) == 0){
+		return;
+  }
+	CHECK((heap = mm_heap_create(region, sizeof(region))) != NULL, "mm_heap_create failed");
+	CHECK(pthread_create(&thread, NULL, pool_worker, heap) == 0, "pthread_create failed");
+	pthread_join(thread, NULL);
+	mm_stats(&after);
+	CHECK(stat_sum(after.splits) >= stat_sum(before.splits) + 50, "pool heap splits were not counted");
+}
+
+//Counts the splits mm_malloc_batch makes carving many blocks from one free
+//block, as many as mallocs one at a time would count.
+static void test_stats_carve(void)
+{
+	static void *blocks[100];
+	struct mm_stats before;
+	struct mm_stats after;
+	struct mm_options opts = {0};
+
+	opts.tcache_count = -1;
+	opts.slab_max = -1;
+	init(&opts);
+	mm_free(mm_malloc(100));
+	mm_stats(&before);
+	if(stat_sum(before.allocs) == 0){
+		return;
+  }
+	CHECK(mm_malloc_batch(200, 100, blocks) == 100, "batch malloc failed");
+	mm_stats(&after);
+	CHECK(stat_sum(after.splits) >= stat_sum(before.splits) + 99, "batch splits were not counted");
+	mm_free_batch(blocks, 100);
+}
+
+//Frees three blocks of one size between guards in the order 2, 0, 1 and
+//mallocs them back. Address order hands out the lowest first, LIFO the
+//last freed and FIFO the first freed. The trailing free block can share
+//their list, so only the order of the three is compared.
+static void test_insert_policy(void)
+{
+	static const int policies[] = { MM_INSERT_ADDRESS, MM_INSERT_LIFO, MM_INSERT_FIFO };
+	static const int expect[][3] = { { 0, 1, 2 }, { 1, 0, 2 }, { 2, 0, 1 } };
+	struct mm_options opts;
+	char *blocks[3];
+	char *ptr;
+	int got[3];
+	int tries;
+	int n;
+	int i;
+	int p;
+
+	for(p = 0; p < 3; p++)
+		{
+			memset(&opts, 0, sizeof(opts));
+			opts.insert_policy = policies[p];
+			opts.fit_scan = 1;
+			opts.tcache_count = -1;
+			opts.slab_max = -1;
+			init(&opts);
+			for(i = 0; i < 3; i++)
+				{
+					CHECK((blocks[i] = mm_malloc(200)) != NULL, "malloc failed");
+					CHECK(mm_malloc(16) != NULL, "malloc failed");
+				}
+			mm_free(blocks[2]);
+			mm_free(blocks[0]);
+			mm_free(blocks[1]);
+			for(n = 0, tries = 0; n < 3 && tries < 6; tries++)
+				{
+					CHECK((ptr = mm_malloc(200)) != NULL, "malloc failed");
+					for(i = 0; i < 3; i++){
+						if(ptr == blocks[i]){
+							got[n++] = i;
+            }
+          }
+				}
+			CHECK(n == 3 && memcmp(got, expect[p], sizeof(got)) == 0, "freed blocks came back in the wrong order");
+		}
+}
+
+//Frees a close fit and then a looser one in the same class under LIFO.
+//First fit takes the looser block at the root, a best-of-4 scan the
+//close one behind it.
+static void test_fit_scan(void)
+{
+	struct mm_options opts;
+	char *close;
+	char *loose;
+	int scan;
+
+	for(scan = 1; scan <= 4; scan += 3)
+		{
+			memset(&opts, 0, sizeof(opts));
+			opts.insert_policy = MM_INSERT_LIFO;
+			opts.fit_scan = scan;
+			opts.sorted_min = -1;
+			opts.tcache_count = -1;
+			opts.slab_max = -1;
+			init(&opts);
+			CHECK((close = mm_malloc(1040)) != NULL, "malloc failed");
+			CHECK(mm_malloc(16) != NULL, "malloc failed");
+			CHECK((loose = mm_malloc(1200)) != NULL, "malloc failed");
+			CHECK(mm_malloc(16) != NULL, "malloc failed");
+			mm_free(close);
+			mm_free(loose);
+			CHECK(mm_malloc(1040) == (scan == 1 ? loose : close), "fit scan picked the wrong block");
+			CHECK(mm_checkheap(MM_CHECK_FULL) == 0, "heap check failed");
+		}
+}
+
+//Fills and empties the free list of one class after another, checking the
+//bitmap index against the lists each time. A re-malloc of the freed size
+//must still find the block, so a set bit was not lost.
+static void test_bitmap(void)
+{
+	struct mm_options opts = {0};
+	size_t size;
+	char *ptr;
+
+	opts.tcache_count = -1;
+	opts.slab_max = -1;
+	opts.mmap_threshold = -1;
+	opts.purge_limit = -1;
+	init(&opts);
+	for(size = 32; size < ((size_t)1 << 20); size += size / 4)
+		{
+			CHECK((ptr = mm_malloc(size)) != NULL, "malloc failed");
+			CHECK(mm_malloc(16) != NULL, "malloc failed");
+			mm_free(ptr);
+			CHECK(mm_checkheap(MM_CHECK_CHEAP) == 0, "bitmap disagrees with the lists after a free");
+			CHECK(mm_malloc(size) == ptr, "freed block was not found");
+			CHECK(mm_checkheap(MM_CHECK_CHEAP) == 0, "bitmap disagrees with a list that emptied");
+		}
+	CHECK(mm_checkheap(MM_CHECK_FULL) == 0, "heap check failed");
+}
+
+//Checks that the first len bytes of ptr still hold byte c.
+static int holds(const char *ptr, int c, size_t len)
+{
+	size_t i;
+
+	for(i = 0; i < len; i++){
+		if(ptr[i] != (char)c){
+			return 0;
+    }
+  }
+	return 1;
+}
+
+//Shrinks a block, which frees its tail, then grows it into the free next
+//block, slides another down into a free previous block and grows the last
+//block of the heap. Only the slide may move the payload.
+static void test_realloc_in_place(void)
+{
+	struct mm_options opts = {0};
+	char *guard;
+	char *prev;
+	char *next;
+	char *ptr;
+
+	opts.tcache_count = -1;
+	opts.slab_max = -1;
+	init(&opts);
+	CHECK((ptr = mm_malloc(2000)) != NULL, "malloc failed");
+	CHECK((guard = mm_malloc(16)) != NULL, "malloc failed");
+	memset(ptr, 0x11, 2000);
+	CHECK(mm_realloc(ptr, 500) == ptr, "shrink moved the block");
+	CHECK(holds(ptr, 0x11, 500), "shrink lost the payload");
+	CHECK((next = mm_malloc(1000)) > ptr && next < guard, "shrink did not free the tail");
+	mm_free(next);
+	CHECK(mm_realloc(ptr, 1800) == ptr, "growth into the free next block moved it");
+	CHECK(holds(ptr, 0x11, 500), "growth lost the payload");
+
+	CHECK((prev = mm_malloc(3000)) != NULL, "malloc failed");
+	CHECK((next = mm_malloc(1000)) != NULL, "malloc failed");
+	//Too big for the gap the growth left, so it lands after next.
+	CHECK(mm_malloc(300) != NULL, "malloc failed");
+	memset(next, 0x22, 1000);
+	mm_free(prev);
+	CHECK(mm_realloc(next, 3500) == prev, "growth did not slide into the free previous block");
+	CHECK(holds(prev, 0x22, 1000), "slide lost the payload");
+
+	CHECK((ptr = mm_malloc(1000)) != NULL, "malloc failed");
+	memset(ptr, 0x33, 1000);
+	CHECK(mm_realloc(ptr, 100000) == ptr, "growth at the end of the heap moved the block");
+	CHECK(holds(ptr, 0x33, 1000), "growth lost the payload");
+	CHECK(mm_checkheap(MM_CHECK_FULL) == 0, "heap check failed");
+}
+
+//Frees and re-mallocs one block, which the deferred bin serves, then frees
+//a run of neighbours one past defer_limit. The flush must coalesce the run
+//into one block that a malloc of its whole size gets back.
+static void test_defer(void)
+{
+	struct mm_options opts = {0};
+	struct mm_stats stats;
+	char *blocks[16];
+	size_t run;
+	int i;
+
+	opts.defer_limit = 15;
+	opts.tcache_count = -1;
+	opts.slab_max = -1;
+	init(&opts);
+	for(i = 0; i < 16; i++){
+		CHECK((blocks[i] = mm_malloc(100)) != NULL, "malloc failed");
+  }
+	CHECK(mm_malloc(16) != NULL, "malloc failed");
+	mm_free(blocks[0]);
+	CHECK(mm_malloc(100) == blocks[0], "deferred block was not reused");
+	for(i = 0; i < 16; i++){
+		mm_free(blocks[i]);
+  }
+	mm_stats(&stats);
+	CHECK(stats.defer_frees == 17 && stats.defer_hits == 1, "deferred frees were not counted");
+	CHECK(stats.defer_flushes == 1 && stats.defer_flushed == 16, "deferred blocks were not flushed");
+	//The run is 16 blocks; ask for all of it less a header word.
+	run = (blocks[15] - blocks[0]) + (blocks[1] - blocks[0]);
+	CHECK(mm_malloc(run - 8) == blocks[0], "deferred blocks were not coalesced");
+	CHECK(mm_checkheap(MM_CHECK_FULL) == 0, "heap check failed");
+}
+
+//Batch mallocs blocks and fills each, so overlapping blocks would clobber
+//one another, then batch frees them with a NULL and a mapped block mixed
+//in. The freed run must coalesce back into one block.
+static void test_batch(void)
+{
+	static void *blocks[1002];
+	struct mm_options opts = {0};
+	char *lowest;
+	int i;
+
+	opts.tcache_count = -1;
+	opts.slab_max = -1;
+	init(&opts);
+	CHECK(mm_malloc_batch(200, 1000, blocks) == 1000, "batch malloc came up short");
+	lowest = blocks[0];
+	for(i = 0; i < 1000; i++)
+		{
+			memset(blocks[i], i, 200);
+			if((char *)blocks[i] < lowest){
+				lowest = blocks[i];
+      }
+		}
+	for(i = 0; i < 1000; i++){
+		CHECK(holds(blocks[i], i, 200), "batch blocks overlap");
+  }
+	blocks[1000] = NULL;
+	CHECK((blocks[1001] = mm_malloc(1 << 20)) != NULL, "malloc failed");
+	mm_free_batch(blocks, 1002);
+	CHECK(mm_checkheap(MM_CHECK_FULL) == 0, "heap check failed after the batch free");
+	CHECK(mm_malloc(200 * 1000) == lowest, "batch free did not coalesce the run");
+}
+
+//Frees and mallocs blocks of size-sorted classes in a random interleaving,
+//each malloc asking for a size some free blocks have. The treap orders by
+//size, then address, so it must hand out the lowest of them. A fixed
+//growth step keeps the trailing free block too small to compete.
+static void test_treap_order(void)
+{
+	static const size_t sizes[] = { 1100, 1500, 2100, 3000, 4200, 6000 };
+	static char *blocks[300];
+	static size_t req[300];
+	static int live[300];
+	struct mm_options opts = {0};
+	char *expect;
+	char *ptr;
+	int op;
+	int i;
+	int j;
+
+	opts.sorted_min = 1024;
+	opts.grow_max = 256;
+	opts.purge_limit = -1;
+	opts.tcache_count = -1;
+	opts.slab_max = -1;
+	init(&opts);
+	srand(7);
+	for(i = 0; i < 300; i++)
+		{
+			req[i] = sizes[rand() % 6];
+			CHECK((blocks[i] = mm_malloc(req[i])) != NULL, "malloc failed");
+			CHECK(mm_malloc(16) != NULL, "malloc failed");
+			live[i] = 1;
+		}
+	for(op = 0; op < 3000; op++)
+		{
+			i = rand() % 300;
+			if(live[i])
+				{
+					mm_free(blocks[i]);
+					live[i] = 0;
+					continue;
+				}
+			expect = NULL;
+			for(j = 0; j < 300; j++){
+				if(!live[j] && req[j] == req[i] && (expect == NULL || blocks[j] < expect)){
+					expect = blocks[j];
+        }
+      }
+			CHECK((ptr = mm_malloc(req[i])) == expect, "treap did not give the lowest block of the size");
+			for(j = 0; blocks[j] != ptr; j++);
+			live[j] = 1;
+		}
+	CHECK(mm_checkheap(MM_CHECK_FULL) == 0, "heap check failed");
+}
+
+//Checks every block the root of a heap file lists, block i holding
+//100 + 40 * i bytes of i.
+static void check_heap_file(struct mm_heap *heap)
+{
+	size_t *root;
+	int i;
+
+	CHECK((root = mm_heap_root(heap)) != NULL, "heap file lost its root");
+	for(i = 0; i < 64; i++){
+		if(root[i] != 0){
+			CHECK(holds((char *)heap + root[i], i, 100 + 40 * i), "heap file lost a block's contents");
+    }
+  }
+	CHECK(mm_heap_check(heap, MM_CHECK_FULL) == 0, "heap file check failed");
+}
+
+//Fills a heap file, frees a block, closes it and reopens it. Then a child
+//frees another block and exits without closing, so the next open has to
+//rebuild the free lists from the blocks. Every reopen must keep the blocks
+//and find the freed one. Blocks are kept as offsets, as the file may be
+//mapped somewhere else.
+static void test_heap_file(void)
+{
+	char path[] = "/tmp/mmtestXXXXXX";
+	struct mm_heap *heap;
+	size_t *root;
+	size_t hole;
+	char *ptr;
+	pid_t pid;
+	int status;
+	int fd;
+	int i;
+
+	init(NULL);
+	CHECK((fd = mkstemp(path)) >= 0, "mkstemp failed");
+	close(fd);
+	unlink(path);
+	CHECK((heap = mm_heap_open(path, 1 << 22)) != NULL, "mm_heap_open failed");
+	CHECK((root = mm_heap_malloc(heap, 64 * sizeof(*root))) != NULL, "heap file malloc failed");
+	for(i = 0; i < 64; i++)
+		{
+			CHECK((ptr = mm_heap_malloc(heap, 100 + 40 * i)) != NULL, "heap file malloc failed");
+			memset(ptr, i, 100 + 40 * i);
+			root[i] = ptr - (char *)heap;
+		}
+	mm_heap_set_root(heap, root);
+	hole = root[10];
+	mm_heap_free(heap, (char *)heap + hole);
+	root[10] = 0;
+	CHECK(mm_heap_close(heap) == 0, "mm_heap_close failed");
+
+	CHECK((heap = mm_heap_open(path, 0)) != NULL, "clean reopen failed");
+	check_heap_file(heap);
+	CHECK(mm_heap_malloc(heap, 100 + 40 * 10) == (char *)heap + hole, "clean reopen lost a free block");
+	hole = ((size_t *)mm_heap_root(heap))[20];
+	CHECK(mm_heap_close(heap) == 0, "mm_heap_close failed");
+
+	CHECK((pid = fork()) >= 0, "fork failed");
+	if(pid == 0)
+		{
+			if((heap = mm_heap_open(path, 0)) == NULL){
+				_exit(1);
+      }
+			root = mm_heap_root(heap);
+			mm_heap_free(heap, (char *)heap + root[20]);
+			root[20] = 0;
+			_exit(0);
+		}
+	CHECK(waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0, "child failed");
+	CHECK((heap = mm_heap_open(path, 0)) != NULL, "recovering open failed");
+	check_heap_file(heap);
+	CHECK(mm_heap_malloc(heap, 100 + 40 * 20) == (char *)heap + hole, "rebuilt heap lost a free block");
+	CHECK(mm_heap_close(heap) == 0, "mm_heap_close failed");
+	unlink(path);
+}
+
+//Walks a heap of many ranges on eight threads and on one, through the
+//used block counts of mm_stats and the full checker. Payloads hold words
+//that look like block headers, so some range guesses go wrong. Both walks
+//must count every live block.
+static void test_walk(void)
+{
+	static char *blocks[40000];
+	struct mm_options opts = {0};
+	struct mm_stats stats;
+	size_t used[2];
+	size_t size;
+	size_t k;
+	int pass;
+	int i;
+
+	opts.tcache_count = -1;
+	opts.slab_max = -1;
+	opts.mmap_threshold = -1;
+	for(pass = 0; pass < 2; pass++)
+		{
+			opts.walk_threads = pass ? 1 : 8;
+			init(&opts);
+			srand(5);
+			for(i = 0; i < 40000; i++)
+				{
+					size = rand() % 3000 + 16;
+					CHECK((blocks[i] = mm_malloc(size)) != NULL, "malloc failed");
+					for(k = 0; k + sizeof(size_t) <= size; k += sizeof(size_t)){
+						*(size_t *)(blocks[i] + k) = (size_t)(rand() % 64) * 16 + (rand() & 3);
+          }
+				}
+			for(i = 0; i < 40000; i += 2){
+				mm_free(blocks[i]);
+      }
+			CHECK(mm_checkheap(MM_CHECK_FULL) == 0, "heap check failed");
+			mm_stats(&stats);
+			CHECK(stats.used_blocks == 20000, "walk missed live blocks");
+			used[pass] = stats.used_bytes;
+		}
+	CHECK(used[0] == used[1], "parallel and serial walks differ");
+}
+
+int main(void)
+{
+	mem_init();
+	test_memalign();
+	test_calloc_mapped();
+	test_free_sized();
+	test_memalign_large();
+	test_remote_drain();
+	test_stats_unregistered();
+	test_stats_carve();
+	test_insert_policy();
+	test_fit_scan();
+	test_bitmap();
+	test_realloc_in_place();
+	test_defer();
+	test_batch();
+	test_treap_order();
+	test_heap_file();
+	test_walk();
+	printf("mmtest: all tests passed\n");
+	return 0;
+}
@@ -0,0 +1,621 @@
+/*
+ * mtbench.c - Multi-threaded scalability benchmarks for the allocator, in
+ * the style of larson, threadtest, xmalloc and cache-scratch. Each run of a
+ * workload at a thread count happens in a child process of its own, so RSS
+ * and heap state never carry over, and reports throughput, sampled per-call
+ * latency percentiles and peak RSS.
+ *
+ * Usage: mtbench [-t max_threads] [-d seconds] [-a allocator]... [-v]
+ *                [-O option=value]... [workload]...
+ *
+ * Allocators are mm, system, jemalloc and tcmalloc; the last two are loaded
+ * with dlopen and skipped when not installed. Thread counts double from 1
+ * up to max_threads, which defaults to the number of CPUs and is always run.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <sys/wait.h>
+
+#include "mm.h"
+#include "memlib.h"
+#include "options.h"
+
+#define MAX_THREADS     256
+#define SAMPLE_EVERY    16	//Calls between latency samples
+#define LAT_BUCKETS     (64 * 8)	//Log2 buckets split in 8 each
+#define RSS_PERIOD_NS   50000000	//RSS sampling period
+#define RSS_SAMPLES     4096
+#define LARSON_SLOTS    1000	//Blocks each larson thread holds
+#define THREADTEST_BATCH 1000	//Blocks each threadtest round allocates
+#define XMALLOC_RING    1024	//Blocks in flight per xmalloc ring
+#define SCRATCH_WRITES  1000	//Writes per cache-scratch object
+#define CACHE_LINE      64
+
+//Gets the maximum and minimum of 2 arguments
+#define MAX(x, y) ((x) > (y) ? (x) : (y))
+#define MIN(x, y) ((x) < (y) ? (x) : (y))
+
+//An allocator under test
+struct allocator {
+	const char *name;
+	const char *const *libs;	//Libraries to dlopen, NULL for built-ins
+	void *(*malloc_fn)(size_t size);
+	void (*free_fn)(void *ptr);
+};
+
+//Per-thread state and results
+struct worker {
+	pthread_t thread;
+	int index;
+	unsigned long long rng;
+	unsigned long ops;		//Calls made
+	unsigned long calls;		//Calls since the last latency sample
+	unsigned long lat[LAT_BUCKETS];	//Sampled latencies
+	uintptr_t first_block;		//cache-scratch: first block after the handoff
+	void *handoff;			//cache-scratch: block to free first
+	char pad[CACHE_LINE];
+};
+
+//Single producer, single consumer ring for xmalloc
+struct ring {
+	void *slot[XMALLOC_RING];
+	unsigned long head;		//Next slot to push, written by the producer
+	char pad[CACHE_LINE];
+	unsigned long tail;		//Next slot to pop, written by the consumer
+	char pad2[CACHE_LINE];
+};
+
+static const char *const jemalloc_libs[] = { "libjemalloc.so.2", "libjemalloc.so", NULL };
+static const char *const tcmalloc_libs[] = { "libtcmalloc_minimal.so.4", "libtcmalloc.so.4", "libtcmalloc_minimal.so", NULL };
+
+static struct allocator allocators[] = {
+	{ "mm", NULL, mm_malloc, mm_free },
+	{ "system", NULL, malloc, free },
+	{ "jemalloc", jemalloc_libs, NULL, NULL },
+	{ "tcmalloc", tcmalloc_libs, NULL, NULL },
+};
+
+static struct allocator *cur;		//Allocator of this child
+static struct worker workers[MAX_THREADS];
+static int nthreads;
+static volatile int stop;		//Set when the run's time is up
+static pthread_barrier_t start_barrier;
+static struct mm_options opts;
+static int verbose;
+
+//larson: arrays of blocks passed between threads through the pool
+static void **larson_pool[MAX_THREADS];
+
+//xmalloc: ring t is filled by thread t and drained by thread t + 1
+static struct ring *rings;
+
+//RSS samples of the current run
+static size_t rss[RSS_SAMPLES];
+static int rss_count;
+
+static void die(const char *msg, const char *arg)
+{
+	fprintf(stderr, "mtbench: %s%s%s\n", msg, arg != NULL ? ": " : "", arg != NULL ? arg : "");
+	exit(1);
+}
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+//Gets a uniformly distributed 64-bit number (splitmix64).
+static unsigned long long rng_next(struct worker *w)
+{
+	unsigned long long z = (w->rng += 0x9e3779b97f4a7c15ULL);
+
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+static size_t rng_range(struct worker *w, size_t lo, size_t hi)
+{
+	return lo + rng_next(w) % (hi - lo + 1);
+}
+
+//Gets the latency bucket of a time: the power of two and 3 bits below it.
+static int lat_bucket(unsigned long long ns)
+{
+	int msb;
+
+	if(ns < 8){
+		return (int)ns;
+  }
+	msb = 63 - __builtin_clzll(ns);
+	return MIN(msb * 8 + (int)((ns >> (msb - 3)) & 7), LAT_BUCKETS - 1);
+}
+
+//Gets the smallest time in a bucket.
+static unsigned long long lat_value(int bucket)
+{
+	int msb = bucket / 8;
+
+	if(bucket < 8){
+		return bucket;
+  }
+	return (8ULL | (bucket & 7)) << (msb - 3);
+}
+
+//Allocates, timing every SAMPLE_EVERY-th call.
+static void * bench_malloc(struct worker *w, size_t size)
+{
+	unsigned long long start;
+	void *ptr;
+
+	w->ops++;
+	if(++w->calls < SAMPLE_EVERY){
+		ptr = cur->malloc_fn(size);
+  }
+	else
+		{
+			w->calls = 0;
+			start = now_ns();
+			ptr = cur->malloc_fn(size);
+			w->lat[lat_bucket(now_ns() - start)]++;
+		}
+	if(ptr == NULL){
+		die("out of memory", cur->name);
+  }
+	return ptr;
+}
+
+//Frees, timing every SAMPLE_EVERY-th call.
+static void bench_free(struct worker *w, void *ptr)
+{
+	unsigned long long start;
+
+	w->ops++;
+	if(++w->calls < SAMPLE_EVERY)
+		{
+			cur->free_fn(ptr);
+			return;
+		}
+	w->calls = 0;
+	start = now_ns();
+	cur->free_fn(ptr);
+	w->lat[lat_bucket(now_ns() - start)]++;
+}
+
+//threadtest: each thread allocates a batch of small blocks, touches them
+//and frees them all, over and over.
+static void * threadtest(void *arg)
+{
+	struct worker *w = arg;
+	void *blocks[THREADTEST_BATCH];
+	int i;
+
+	pthread_barrier_wait(&start_barrier);
+	while(!stop)
+		{
+			for(i = 0; i < THREADTEST_BATCH; i++)
+				{
+					blocks[i] = bench_malloc(w, 64);
+					*(char *)blocks[i] = (char)i;
+				}
+			for(i = 0; i < THREADTEST_BATCH; i++){
+				bench_free(w, blocks[i]);
+      }
+		}
+	return NULL;
+}
+
+//larson: each thread replaces random blocks of its array with blocks of
+//random size, and every so often swaps the array for one another thread
+//left in the pool, so blocks are freed by threads that did not allocate
+//them.
+static void * larson(void *arg)
+{
+	struct worker *w = arg;
+	void **blocks = larson_pool[w->index];
+	int round;
+	int i;
+
+	larson_pool[w->index] = NULL;
+	pthread_barrier_wait(&start_barrier);
+	while(!stop)
+		{
+			for(round = 0; round < 10000; round++)
+				{
+					i = (int)rng_range(w, 0, LARSON_SLOTS - 1);
+					bench_free(w, blocks[i]);
+					blocks[i] = bench_malloc(w, rng_range(w, 16, 512));
+				}
+			//Hand the array over and take the one left in a random slot.
+			i = (int)rng_range(w, 0, nthreads - 1);
+			blocks = __atomic_exchange_n(&larson_pool[i], blocks, __ATOMIC_ACQ_REL);
+			while(blocks == NULL)
+				{
+					i = (i + 1) % nthreads;
+					blocks = __atomic_exchange_n(&larson_pool[i], NULL, __ATOMIC_ACQ_REL);
+				}
+		}
+	//Park the array for the cleanup.
+	for(i = 0; blocks != NULL; i = (i + 1) % nthreads){
+		blocks = __atomic_exchange_n(&larson_pool[i], blocks, __ATOMIC_ACQ_REL);
+  }
+	return NULL;
+}
+
+//xmalloc: thread t allocates into ring t and frees what thread t - 1 put
+//in ring t - 1, so with two or more threads every free is remote.
+static void * xmalloc_bench(void *arg)
+{
+	struct worker *w = arg;
+	struct ring *out = &rings[w->index];
+	struct ring *in = &rings[(w->index + nthreads - 1) % nthreads];
+	unsigned long pos;
+	int i;
+
+	pthread_barrier_wait(&start_barrier);
+	while(!stop)
+		{
+			for(i = 0; i < 64; i++)
+				{
+					pos = out->head;
+					if(pos - __atomic_load_n(&out->tail, __ATOMIC_ACQUIRE) == XMALLOC_RING){
+						break;
+          }
+					out->slot[pos % XMALLOC_RING] = bench_malloc(w, rng_range(w, 16, 256));
+					__atomic_store_n(&out->head, pos + 1, __ATOMIC_RELEASE);
+				}
+			for(i = 0; i < 64; i++)
+				{
+					pos = in->tail;
+					if(pos == __atomic_load_n(&in->head, __ATOMIC_ACQUIRE)){
+						break;
+          }
+					bench_free(w, in->slot[pos % XMALLOC_RING]);
+					__atomic_store_n(&in->tail, pos + 1, __ATOMIC_RELEASE);
+				}
+		}
+	return NULL;
+}
+
+//cache-scratch: every thread starts by freeing a tiny block the main thread
+//allocated next to the other threads' blocks, then allocates, writes and
+//frees tiny blocks of its own. An allocator that hands the freed block
+//back has the threads write to a shared cache line.
+static void * cache_scratch(void *arg)
+{
+	struct worker *w = arg;
+	volatile char *ptr;
+	int i;
+
+	pthread_barrier_wait(&start_barrier);
+	bench_free(w, w->handoff);
+	while(!stop)
+		{
+			ptr = bench_malloc(w, 8);
+			if(w->first_block == 0){
+				w->first_block = (uintptr_t)ptr;
+      }
+			for(i = 0; i < SCRATCH_WRITES; i++){
+				ptr[i & 7]++;
+      }
+			bench_free(w, (void *)ptr);
+		}
+	return NULL;
+}
+
+//Gets the resident set size from /proc.
+static size_t read_rss(void)
+{
+	unsigned long pages = 0;
+	unsigned long resident = 0;
+	FILE *f = fopen("/proc/self/statm", "r");
+
+	if(f == NULL){
+		return 0;
+  }
+	if(fscanf(f, "%lu %lu", &pages, &resident) != 2){
+		resident = 0;
+  }
+	fclose(f);
+	return resident * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+//Samples the RSS every RSS_PERIOD_NS until the run stops.
+static void * rss_sampler(void *arg)
+{
+	struct timespec period = { 0, RSS_PERIOD_NS };
+
+	(void)arg;
+	while(!stop && rss_count < RSS_SAMPLES)
+		{
+			rss[rss_count++] = read_rss();
+			nanosleep(&period, NULL);
+		}
+	return NULL;
+}
+
+//Resolves an allocator from its libraries. Returns 0 when none loads.
+static int load_allocator(struct allocator *a)
+{
+	const char *const *lib;
+	void *handle;
+
+	if(a->libs == NULL){
+		return 1;
+  }
+	for(lib = a->libs; *lib != NULL; lib++)
+		{
+			if((handle = dlopen(*lib, RTLD_NOW | RTLD_LOCAL)) == NULL){
+				continue;
+      }
+			a->malloc_fn = (void *(*)(size_t))dlsym(handle, "malloc");
+			a->free_fn = (void (*)(void *))dlsym(handle, "free");
+			if(a->malloc_fn != NULL && a->free_fn != NULL){
+				return 1;
+      }
+			dlclose(handle);
+		}
+	return 0;
+}
+
+//Gets a latency percentile from the merged histogram.
+static unsigned long long percentile(const unsigned long *lat, unsigned long total, double p)
+{
+	unsigned long want = (unsigned long)(total * p);
+	unsigned long seen = 0;
+	int i;
+
+	for(i = 0; i < LAT_BUCKETS; i++)
+		{
+			seen += lat[i];
+			if(seen > want){
+				return lat_value(i);
+      }
+		}
+	return lat_value(LAT_BUCKETS - 1);
+}
+
+//Counts cache-scratch threads whose first block shares a cache line with
+//another thread's first block.
+static int shared_lines(void)
+{
+	int shared = 0;
+	int i;
+	int j;
+
+	for(i = 0; i < nthreads; i++)
+		{
+			for(j = 0; j < nthreads; j++)
+				{
+					if(i != j && workers[i].first_block / CACHE_LINE == workers[j].first_block / CACHE_LINE)
+						{
+							shared++;
+							break;
+						}
+				}
+		}
+	return shared;
+}
+
+//Runs one workload at one thread count and prints its result line. Runs
+//in a child process.
+static void run(const char *workload, double secs)
+{
+	void *(*body)(void *);
+	unsigned long lat[LAT_BUCKETS] = { 0 };
+	unsigned long samples = 0;
+	unsigned long ops = 0;
+	unsigned long long start;
+	unsigned long long elapsed;
+	struct timespec duration;
+	pthread_t sampler;
+	size_t peak_rss = 0;
+	int i;
+	int j;
+
+	if(cur->malloc_fn == mm_malloc)
+		{
+			mem_init();
+			if(mm_init_opts(&opts) < 0){
+				die("mm_init_opts failed", NULL);
+      }
+		}
+	if(strcmp(workload, "threadtest") == 0){
+		body = threadtest;
+  }
+	else if(strcmp(workload, "larson") == 0)
+		{
+			body = larson;
+			for(i = 0; i < nthreads; i++)
+				{
+					larson_pool[i] = malloc(LARSON_SLOTS * sizeof(void *));
+					for(j = 0; j < LARSON_SLOTS; j++){
+						larson_pool[i][j] = cur->malloc_fn(16 + (j * 37) % 497);
+          }
+				}
+		}
+	else if(strcmp(workload, "xmalloc") == 0)
+		{
+			body = xmalloc_bench;
+			rings = calloc(nthreads, sizeof(*rings));
+		}
+	else if(strcmp(workload, "cache-scratch") == 0)
+		{
+			body = cache_scratch;
+			for(i = 0; i < nthreads; i++){
+				workers[i].handoff = cur->malloc_fn(8);
+      }
+		}
+	else
+		{
+			die("unknown workload", workload);
+		}
+	for(i = 0; i < nthreads; i++)
+		{
+			workers[i].index = i;
+			workers[i].rng = 0x1234567ULL * (i + 1);
+		}
+	pthread_barrier_init(&start_barrier, NULL, nthreads + 1);
+	for(i = 0; i < nthreads; i++){
+		pthread_create(&workers[i].thread, NULL, body, &workers[i]);
+  }
+	pthread_create(&sampler, NULL, rss_sampler, NULL);
+	pthread_barrier_wait(&start_barrier);
+	start = now_ns();
+	duration.tv_sec = (time_t)secs;
+	duration.tv_nsec = (long)((secs - (time_t)secs) * 1e9);
+	nanosleep(&duration, NULL);
+	stop = 1;
+	for(i = 0; i < nthreads; i++){
+		pthread_join(workers[i].thread, NULL);
+  }
+	elapsed = now_ns() - start;
+	pthread_join(sampler, NULL);
+
+	for(i = 0; i < nthreads; i++)
+		{
+			ops += workers[i].ops;
+			for(j = 0; j < LAT_BUCKETS; j++)
+				{
+					lat[j] += workers[i].lat[j];
+					samples += workers[i].lat[j];
+				}
+		}
+	for(i = 0; i < rss_count; i++){
+		peak_rss = MAX(peak_rss, rss[i]);
+  }
+	printf("%-9s %-14s %3d %10.2f %8llu %8llu %8llu %9.1f",
+	       cur->name, workload, nthreads, ops / (elapsed * 1e-9) / 1e6,
+	       percentile(lat, samples, 0.50), percentile(lat, samples, 0.99),
+	       percentile(lat, samples, 0.999), peak_rss / 1048576.0);
+	if(body == cache_scratch){
+		printf("  shared lines %d/%d", shared_lines(), nthreads);
+  }
+	printf("\n");
+	if(verbose)
+		{
+			printf("  rss MB:");
+			for(i = 0; i < rss_count; i++){
+				printf(" %.1f", rss[i] / 1048576.0);
+      }
+			printf("\n");
+		}
+	fflush(stdout);
+}
+
+static void set_option(const char *arg)
+{
+	int ret = option_set(&opts, arg);
+
+	if(ret == -1){
+		die("expected option=value", arg);
+  }
+	if(ret == -2){
+		die("unknown option", arg);
+  }
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+	        "usage: mtbench [-t max_threads] [-d seconds] [-a allocator]... [-v] [-O option=value]... [workload]...\n"
+	        "  -t  largest thread count, counts double from 1 (default: CPUs)\n"
+	        "  -d  seconds per run (default 1)\n"
+	        "  -a  mm, system, jemalloc or tcmalloc (default: all)\n"
+	        "  -v  print the RSS samples of each run\n"
+	        "  -O  set an mm_options field, e.g. -O arenas=4\n"
+	        "workloads: threadtest, larson, xmalloc, cache-scratch (default: all)\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	static const char *const all_workloads[] = { "threadtest", "larson", "xmalloc", "cache-scratch" };
+	const char *const *workloads = all_workloads;
+	int workload_count = 4;
+	int max_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	int selected[sizeof(allocators) / sizeof(allocators[0])] = { 0 };
+	int any_selected = 0;
+	double secs = 1.0;
+	size_t a;
+	size_t i;
+	pid_t pid;
+	int status;
+	int c;
+
+	while((c = getopt(argc, argv, "t:d:a:vO:")) != -1)
+		{
+			switch(c)
+				{
+				case 't': max_threads = atoi(optarg); break;
+				case 'd': secs = atof(optarg); break;
+				case 'v': verbose = 1; break;
+				case 'O': set_option(optarg); break;
+				case 'a':
+					for(a = 0; a < sizeof(allocators) / sizeof(allocators[0]); a++)
+						{
+							if(strcmp(allocators[a].name, optarg) == 0){
+								break;
+              }
+						}
+					if(a == sizeof(allocators) / sizeof(allocators[0])){
+						die("unknown allocator", optarg);
+          }
+					selected[a] = 1;
+					any_selected = 1;
+					break;
+				default: usage();
+				}
+		}
+	if(optind < argc)
+		{
+			workloads = (const char *const *)&argv[optind];
+			workload_count = argc - optind;
+		}
+	max_threads = MAX(1, MIN(max_threads, MAX_THREADS));
+	printf("%-9s %-14s %3s %10s %8s %8s %8s %9s\n",
+	       "allocator", "workload", "thr", "Mops/s", "p50 ns", "p99 ns", "p999 ns", "peak RSS");
+	for(a = 0; a < sizeof(allocators) / sizeof(allocators[0]); a++)
+		{
+			if(any_selected && !selected[a]){
+				continue;
+      }
+			if(!load_allocator(&allocators[a]))
+				{
+					printf("%-9s not installed, skipped\n", allocators[a].name);
+					continue;
+				}
+			cur = &allocators[a];
+			for(i = 0; i < (size_t)workload_count; i++)
+				{
+					for(nthreads = 1; nthreads <= max_threads;
+					    nthreads = (nthreads == max_threads) ? nthreads + 1 : MIN(2 * nthreads, max_threads))
+						{
+							fflush(stdout);
+							if((pid = fork()) < 0){
+								die("fork failed", NULL);
+              }
+							if(pid == 0)
+								{
+									run(workloads[i], secs);
+									_exit(0);
+								}
+							waitpid(pid, &status, 0);
+							if(!WIFEXITED(status) || WEXITSTATUS(status) != 0){
+								printf("%-9s %-14s %3d failed\n", cur->name, workloads[i], nthreads);
+              }
+						}
+				}
+		}
+	return 0;
+}
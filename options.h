@@ -0,0 +1,64 @@
+/*
+ * options.h - The mm_options fields the drivers let -O name=value set,
+ * shared so bench and mtbench accept the same options. Include it after
+ * mm.h.
+ */
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+//mm_options fields settable with -O
+static const struct {
+	const char *name;
+	size_t offset;
+	int is_long;
+} option_fields[] = {
+	{ "insert_policy", offsetof(struct mm_options, insert_policy), 0 },
+	{ "fit_scan", offsetof(struct mm_options, fit_scan), 0 },
+	{ "sorted_min", offsetof(struct mm_options, sorted_min), 1 },
+	{ "split_shift", offsetof(struct mm_options, split_shift), 0 },
+	{ "high_min", offsetof(struct mm_options, high_min), 1 },
+	{ "tcache_count", offsetof(struct mm_options, tcache_count), 0 },
+	{ "arenas", offsetof(struct mm_options, arenas), 0 },
+	{ "numa", offsetof(struct mm_options, numa), 0 },
+	{ "slab_max", offsetof(struct mm_options, slab_max), 0 },
+	{ "mmap_threshold", offsetof(struct mm_options, mmap_threshold), 1 },
+	{ "grow_max", offsetof(struct mm_options, grow_max), 1 },
+	{ "trim_threshold", offsetof(struct mm_options, trim_threshold), 1 },
+	{ "huge_pages", offsetof(struct mm_options, huge_pages), 0 },
+	{ "purge_limit", offsetof(struct mm_options, purge_limit), 1 },
+	{ "remote_queue", offsetof(struct mm_options, remote_queue), 0 },
+	{ "defer_limit", offsetof(struct mm_options, defer_limit), 0 },
+	{ "walk_threads", offsetof(struct mm_options, walk_threads), 0 },
+	{ "check_every", offsetof(struct mm_options, check_every), 0 },
+	{ "check_level", offsetof(struct mm_options, check_level), 0 },
+};
+
+//Sets the field of opts a name=value argument names. Returns -1 for an
+//argument without '=' and -2 for a name that is not an option.
+static int option_set(struct mm_options *opts, const char *arg)
+{
+	const char *eq = strchr(arg, '=');
+	size_t i;
+	long value;
+
+	if(eq == NULL){
+		return -1;
+  }
+	value = strtol(eq + 1, NULL, 0);
+	for(i = 0; i < sizeof(option_fields) / sizeof(option_fields[0]); i++)
+		{
+			if(strlen(option_fields[i].name) == (size_t)(eq - arg) &&
+			   strncmp(option_fields[i].name, arg, eq - arg) == 0)
+				{
+					if(option_fields[i].is_long){
+						*(long *)((char *)opts + option_fields[i].offset) = value;
+          }
+					else{
+						*(int *)((char *)opts + option_fields[i].offset) = (int)value;
+          }
+					return 0;
+				}
+		}
+	return -2;
+}